@@ -26,266 +26,3643 @@ SOFTWARE.
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <list>
+#include <unordered_map>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <array>
 #include <string>
+#include <string_view>
 #include <span>
 #include <ranges>
 #include <algorithm>
-#include <format>
+#include <thread>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <exception>
+#include <iterator>
+#include <charconv>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <deque>
+#include <random>
+#ifdef HEXFILEINFO_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HEXFILEINFO_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#endif
+#include "HexFileParser.h"
 
 static std::string progName = "HexFileInfo";
-static std::string inFileName = "stdin";
+static std::string uf2FileName;
+static std::string memfdSocketName;
+static bool multiImage = false;
+static std::string outFileName;
+static bool rebase = false;
+static int64_t rebaseOffset = 0;
+static bool insertCrc = false;
+static unsigned crcAddress = 0;
+static unsigned crcRangeStart = 0;
+static uint64_t crcRangeEnd = 0;
+static unsigned char crcFill = 0xFF;
+static std::string verifyFileName;
 
-static void throwError(const char* message)
+struct AddressRange
 {
-    throw std::runtime_error(message);
+    unsigned start;
+    uint64_t end; // address after the range
+};
+static std::vector<AddressRange> ignoreRanges; // sorted and merged
+static std::string mapFileName;
+static bool showEntropy = false;
+static unsigned entropyPageSize = 0x1000;
+static double minEntropy = 0.0;
+static double maxEntropy = 8.0;
+static unsigned numJobs = 0;
+static std::string traceFileName;
+static std::string metricsFileName;
+static unsigned numSlowestFiles = 0;
+static bool showStats = false;
+static bool showProgress = false;
+
+enum ioMode_t {
+    ioBuffered, // ordinary buffered reads through the page cache
+    ioDirect, // O_DIRECT, bypassing the page cache
+    ioDontNeed, // buffered reads, dropping the pages from the cache once read
+    ioHot // mmap with read-ahead and huge pages
+};
+static ioMode_t ioMode = ioBuffered;
+static unsigned cacheSizeMB = 0;
+static size_t readBufferSize = 0; // 0 for the default of the I/O mode
+static bool background = false;
+static unsigned maxReadRateMB = 0; // megabytes per second, 0 for no limit
+static unsigned uf2FamilyId = 0xE48BFF56; // RP2040
+
+// PerThread - A separate object for each thread, so threads can update their
+// own without locking
+// The lock is only taken when a thread first uses it. The objects of all threads
+// can be read when no other threads are running.
+template<typename T>
+class PerThread
+{
+public:
+    T& get()
+    {
+        if (!current) {
+            std::lock_guard lock(mutex);
+            current = &items.emplace_back();
+        }
+        return *current;
+    }
+    const std::list<T>& all() const
+    {
+        return items;
+    }
+
+private:
+    std::mutex mutex;
+    std::list<T> items;
+    static thread_local T* current;
+};
+
+template<typename T>
+thread_local T* PerThread<T>::current = nullptr;
+
+// Tracing
+// With --trace, spans of time are recorded for each thread and written at the
+// end in Chrome's trace event format, which can be viewed with Perfetto
+// (https://ui.perfetto.dev).
+
+struct TraceEvent
+{
+    const char* name;
+    std::string arg;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+struct TraceBuffer
+{
+    unsigned threadId = 0;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+};
+
+static bool traceEnabled = false;
+static const std::chrono::steady_clock::time_point traceStartTime = std::chrono::steady_clock::now();
+static PerThread<TraceBuffer> traceBuffers;
+static std::atomic<unsigned> numTraceThreads = 0;
+
+static TraceBuffer& getTraceBuffer()
+{
+    TraceBuffer& buffer = traceBuffers.get();
+    if (buffer.threadId == 0) {
+        buffer.threadId = ++numTraceThreads;
+        buffer.threadName = std::format("thread {}", buffer.threadId);
+    }
+    return buffer;
+}
+
+static void setTraceThreadName(std::string name)
+{
+    if (traceEnabled) {
+        getTraceBuffer().threadName = std::move(name);
+    }
+}
+
+// TraceSpan - Records the time from its construction until it ends or is destroyed
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char* name, std::string_view arg = {})
+    {
+        if (traceEnabled) {
+            this->name = name;
+            this->arg = arg;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~TraceSpan()
+    {
+        end();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void end()
+    {
+        if (name) {
+            getTraceBuffer().events.push_back({ name, std::move(arg), start, std::chrono::steady_clock::now() });
+            name = nullptr;
+        }
+    }
+
+private:
+    const char* name = nullptr;
+    std::string arg;
+    std::chrono::steady_clock::time_point start;
+};
+
+static std::string jsonEscape(std::string_view str)
+{
+    std::string escaped;
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            escaped += '\\';
+            escaped += ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            escaped += std::format("\\u{:04x}", unsigned(ch));
+        } else {
+            escaped += ch;
+        }
+    }
+    return escaped;
+}
+
+// writeTraceFile - Write the recorded spans of all threads
+// This must only be called when no other threads are running.
+static void writeTraceFile(const std::string& fileName)
+{
+    std::ofstream outFile(fileName, std::ios::out | std::ios::binary);
+    if (outFile.fail()) {
+        throwFileError("Failed to create file", fileName);
+    }
+    auto micros = [](std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration<double, std::micro>(time - traceStartTime).count();
+    };
+    outFile << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    const char* separator = "\n";
+    for (const TraceBuffer& buffer : traceBuffers.all()) {
+        outFile << separator << std::format(R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}})",
+            buffer.threadId, jsonEscape(buffer.threadName));
+        separator = ",\n";
+        for (const TraceEvent& event : buffer.events) {
+            outFile << separator << std::format(R"({{"name":"{}","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f})",
+                event.name, buffer.threadId, micros(event.start), micros(event.end) - micros(event.start));
+            if (!event.arg.empty()) {
+                outFile << std::format(R"(,"args":{{"file":"{}"}})", jsonEscape(event.arg));
+            }
+            outFile << "}";
+        }
+    }
+    outFile << "\n]}\n";
+    outFile.close();
+    if (outFile.fail()) {
+        throwFileError("Error writing file", fileName);
+    }
+}
+
+// parseNumber - Parse a numeric command-line argument (decimal, or hex with 0x prefix)
+static unsigned parseNumber(const char* str)
+{
+    char* end = nullptr;
+    errno = 0;
+    unsigned long n = std::strtoul(str, &end, 0);
+    if (end == str || *end != '\0' || errno != 0 || n > UINT_MAX) {
+        throwError(std::format("Invalid number {}", str).c_str());
+    }
+    return unsigned(n);
+}
+
+// parseRange - Parse a command-line argument of the form MIN:MAX
+static void parseRange(const char* str, double& min, double& max)
+{
+    char* end = nullptr;
+    min = std::strtod(str, &end);
+    if (end == str || *end != ':') {
+        throwError(std::format("Invalid range {}", str).c_str());
+    }
+    const char* strMax = end + 1;
+    max = std::strtod(strMax, &end);
+    if (end == strMax || *end != '\0' || min > max) {
+        throwError(std::format("Invalid range {}", str).c_str());
+    }
+}
+
+// parseAddressRange - Parse a command-line argument of the form START:END
+// END is the address after the range.
+static void parseAddressRange(const char* str, unsigned& start, uint64_t& end)
+{
+    std::string_view stRange = str;
+    size_t colon = stRange.find(':');
+    if (colon == stRange.npos) {
+        throwError(std::format("Invalid range {}", str).c_str());
+    }
+    start = parseNumber(std::string(stRange.substr(0, colon)).c_str());
+    std::string stEnd(stRange.substr(colon + 1));
+    // The end may be just past the top of the address space.
+    char* endPtr = nullptr;
+    errno = 0;
+    end = std::strtoull(stEnd.c_str(), &endPtr, 0);
+    if (stEnd.empty() || *endPtr != '\0' || errno != 0 || end > (uint64_t(1) << 32) || end <= start) {
+        throwError(std::format("Invalid range {}", str).c_str());
+    }
+}
+
+// parseOffset - Parse a signed numeric command-line argument
+static int64_t parseOffset(const char* str)
+{
+    bool negative = (*str == '-');
+    int64_t n = parseNumber(negative ? str + 1 : str);
+    return negative ? -n : n;
+}
+
+// Input files
+// With --io, input files are read by FileStreamBuf instead of std::ifstream, to
+// control how they use the page cache. The default reads through the cache as usual.
+// The other modes are only available on Linux.
+
+const char* const ioModeNames[] = { "buffered", "direct", "dontneed", "hot" };
+
+// parseIoMode - Parse the --io command-line argument
+static ioMode_t parseIoMode(std::string_view str)
+{
+    ioMode_t mode;
+    if (str == "buffered") {
+        mode = ioBuffered;
+    } else if (str == "direct") {
+        mode = ioDirect;
+    } else if (str == "dontneed") {
+        mode = ioDontNeed;
+    } else if (str == "hot") {
+        mode = ioHot;
+    } else {
+        throwError(std::format("Invalid I/O mode {}", str).c_str());
+    }
+#ifndef __linux__
+    if (mode != ioBuffered) {
+        throwError("--io is only supported on Linux");
+    }
+#endif
+    return mode;
+}
+
+// parseReadBufferSize - Parse the --read-buffer command-line argument
+static size_t parseReadBufferSize(const char* str)
+{
+    unsigned size = parseNumber(str);
+    if (size < 0x1000 || size > 0x4000000) {
+        throwError(std::format("Invalid read buffer size {}", str).c_str());
+    }
+    return size;
+}
+
+#ifdef __linux__
+// FileStreamBuf - Input stream buffer that reads a file with a given I/O mode
+// Direct reads need a buffer aligned to the device's block size; 4 kB covers all
+// common devices. If the file system doesn't support O_DIRECT (e.g. tmpfs),
+// the file is read in dontneed mode instead. The buffer size is rounded up to
+// a multiple of that.
+class FileStreamBuf : public std::streambuf
+{
+public:
+    static constexpr size_t defaultBufferSize = 0x100000;
+
+    FileStreamBuf(const std::string& fileName, ioMode_t mode) : mode(mode)
+    {
+        if (mode == ioDirect) {
+            fd = ::open(fileName.c_str(), O_RDONLY | O_DIRECT);
+            if (fd < 0 && errno == EINVAL) {
+                this->mode = ioDontNeed;
+            }
+        }
+        if (fd < 0) {
+            fd = ::open(fileName.c_str(), O_RDONLY);
+        }
+        if (fd < 0) {
+            throwFileError("Failed to open file", fileName);
+        }
+        if (this->mode == ioHot) {
+            map();
+        } else {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (readBufferSize > 0) {
+                bufferSize = (readBufferSize + bufferAlignment - 1) / bufferAlignment * bufferAlignment;
+            }
+            buffer = static_cast<char*>(::operator new(bufferSize, std::align_val_t(bufferAlignment)));
+            countMemory(memReadBuffer, bufferSize);
+        }
+    }
+
+    ~FileStreamBuf()
+    {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mappingSize);
+        }
+        if (buffer) {
+            countMemory(memReadBuffer, -int64_t(bufferSize));
+            ::operator delete(buffer, std::align_val_t(bufferAlignment));
+        }
+        if (mode == ioDontNeed || mode == ioDirect) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        ::close(fd);
+    }
+
+    FileStreamBuf(const FileStreamBuf&) = delete;
+    FileStreamBuf& operator=(const FileStreamBuf&) = delete;
+
+protected:
+    // underflow - Read the next block of the file into the buffer
+    // A read error is thrown, which makes the istream set badbit.
+    int_type underflow() override
+    {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        if (!buffer) {
+            return traits_type::eof();
+        }
+        ssize_t size;
+        do {
+            size = ::pread(fd, buffer, bufferSize, offset);
+        } while (size < 0 && errno == EINTR);
+        if (size < 0) {
+            throwError("Read error");
+        }
+        if (mode == ioDontNeed && size > 0) {
+            posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+        }
+        offset += size;
+        setg(buffer, buffer, buffer + size);
+        return size > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+    }
+
+private:
+    // map - Map the whole file into memory and read it from there
+    void map()
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throwError("Read error");
+        }
+        mappingSize = size_t(st.st_size);
+        if (mappingSize == 0) {
+            return;
+        }
+        mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            throwError("Read error");
+        }
+        // These are only hints, so failures are ignored. Huge pages for file
+        // mappings depend on the kernel and the file system.
+        madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+        madvise(mapping, mappingSize, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        madvise(mapping, mappingSize, MADV_HUGEPAGE);
+#endif
+        char* data = static_cast<char*>(mapping);
+        setg(data, data, data + mappingSize);
+    }
+
+    static constexpr size_t bufferAlignment = 0x1000;
+    ioMode_t mode;
+    size_t bufferSize = defaultBufferSize;
+    int fd = -1;
+    char* buffer = nullptr;
+    off_t offset = 0;
+    void* mapping = MAP_FAILED;
+    size_t mappingSize = 0;
+};
+
+// getPageCacheResidency - Get the number of bytes of a file that are in the page cache
+static uint64_t getPageCacheResidency(const char* fileName)
+{
+    int fd = ::open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    uint64_t resident = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = size_t(st.st_size);
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+            std::vector<unsigned char> pages((size + pageSize - 1) / pageSize);
+            if (mincore(mapping, size, pages.data()) == 0) {
+                resident = std::ranges::count_if(pages, [](unsigned char page) { return page & 1; }) * uint64_t(pageSize);
+                resident = std::min<uint64_t>(resident, size);
+            }
+            munmap(mapping, size);
+        }
+    }
+    ::close(fd);
+    return resident;
+}
+#endif
+
+// makeHexRecord - Format one record of a hex file, without the line ending
+static std::string makeHexRecord(recordType_t recordType, unsigned address, std::span<const unsigned char> data)
+{
+    unsigned char checksum = static_cast<unsigned char>(data.size() + (address >> 8) + address + recordType);
+    std::string line = std::format(":{:02X}{:04X}{:02X}", data.size(), address & 0xFFFF, unsigned(recordType));
+    for (unsigned char byte : data) {
+        line += std::format("{:02X}", byte);
+        checksum += byte;
+    }
+    line += std::format("{:02X}", static_cast<unsigned char>(-checksum));
+    return line;
+}
+
+static std::string makeHexRecord(recordType_t recordType, unsigned value16)
+{
+    unsigned char data[] = { static_cast<unsigned char>(value16 >> 8), static_cast<unsigned char>(value16) };
+    return makeHexRecord(recordType, 0, data);
+}
+
+static std::string makeStartRecord(unsigned startAddress)
+{
+    unsigned char data[] = { static_cast<unsigned char>(startAddress >> 24), static_cast<unsigned char>(startAddress >> 16),
+        static_cast<unsigned char>(startAddress >> 8), static_cast<unsigned char>(startAddress) };
+    return makeHexRecord(typeSla, 0, data);
+}
+
+// writeHexFile - Write the image data to a hex file, 16 bytes per data record
+static void writeHexFile(const ImageInfo& info, std::ostream& output)
+{
+    const unsigned recordSize = 16;
+    unsigned baseAddress = 0;
+    bool baseWritten = false;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        for (unsigned offset = 0; offset < chunk.size;) {
+            unsigned address = chunk.address + offset;
+            if (!baseWritten || (address & 0xFFFF0000) != baseAddress) {
+                baseAddress = address & 0xFFFF0000;
+                output << makeHexRecord(typeEla, baseAddress >> 16) << '\n';
+                baseWritten = true;
+            }
+            // Records don't cross a 64K boundary.
+            unsigned size = std::min({ recordSize, chunk.size - offset, 0x10000 - (address & 0xFFFF) });
+            output << makeHexRecord(typeData, address, std::span(chunk.data).subspan(offset, size)) << '\n';
+            offset += size;
+        }
+    }
+    if (info.numStartAddresses > 0) {
+        output << makeStartRecord(info.startAddress) << '\n';
+    }
+    output << makeHexRecord(typeEof, 0, {}) << '\n';
+}
+
+// rebaseImage - Move the image data and start address by the given offset
+static void rebaseImage(ImageInfo& info, int64_t offset)
+{
+    const int64_t addressLimit = int64_t(1) << 32;
+    for (Chunk& chunk : info.chunks) {
+        int64_t address = chunk.address + offset;
+        if (address < 0 || address + chunk.size > addressLimit) {
+            throwError(std::format("Rebased data out of range at 0x{:X}", chunk.address).c_str());
+        }
+        chunk.address = unsigned(address);
+    }
+    if (info.numStartAddresses > 0) {
+        int64_t address = info.startAddress + offset;
+        if (address < 0 || address >= addressLimit) {
+            throwError("Rebased start address out of range");
+        }
+        info.startAddress = unsigned(address);
+    }
+}
+
+// rebaseHexText - Rebase a hex file by a multiple of 64K by rewriting its
+// extended linear address and start address records
+// Everything else is copied unchanged. The text must already have been
+// validated and must not contain segment address records.
+static void rebaseHexText(std::string_view text, std::ostream& output, int64_t offset)
+{
+    const int64_t offset64K = offset >> 16;
+    bool baseSeen = false;
+    size_t copyStart = 0;
+    for (size_t pos = 0; pos < text.size();) {
+        size_t eol = text.find('\n', pos);
+        size_t next = (eol == text.npos) ? text.size() : eol + 1;
+        std::string_view line = text.substr(pos, next - pos);
+        std::string_view lineEnd = line.substr(line.find_last_not_of("\r\n") + 1);
+        line.remove_suffix(lineEnd.size());
+        std::string_view type = line.substr(7, 2);
+        std::string newLine;
+        if (type == "04") {
+            std::string stValue(line.substr(9, 4));
+            int64_t value = fromHex(stValue) + offset64K;
+            if (value < 0 || value > 0xFFFF) {
+                throwError("Rebased data out of range");
+            }
+            newLine = makeHexRecord(typeEla, unsigned(value));
+            baseSeen = true;
+        } else if (type == "05") {
+            std::string stValue(line.substr(9, 8));
+            newLine = makeStartRecord(unsigned(fromHex(stValue) + offset));
+        } else if (type == "00" && !baseSeen && offset64K != 0) {
+            // Data at the start of the file is based at 0, so it needs a new base record.
+            newLine = makeHexRecord(typeEla, unsigned(offset64K));
+            newLine += lineEnd;
+            newLine += line;
+            baseSeen = true;
+        }
+        if (!newLine.empty()) {
+            output.write(text.data() + copyStart, std::streamsize(pos - copyStart));
+            output << newLine << (lineEnd.empty() ? "\n" : lineEnd);
+            copyStart = next;
+        }
+        pos = next;
+    }
+    output.write(text.data() + copyStart, std::streamsize(text.size() - copyStart));
+}
+
+// writeRebasedHexFile - Write a rebased copy of the input hex file
+// If possible only the address records are rewritten, otherwise the whole
+// image is re-encoded.
+static void writeRebasedHexFile(ImageInfo& info, std::string_view text, const std::string& fileName, int64_t offset,
+    std::ostream& out)
+{
+    bool rewriteRecords = (offset % 0x10000 == 0) && !text.empty() && !info.hasSegmentRecords;
+    rebaseImage(info, offset);
+    std::ofstream outFile(fileName, std::ios::out);
+    if (outFile.fail()) {
+        throwFileError("Failed to create file", fileName);
+    }
+    if (rewriteRecords) {
+        rebaseHexText(text, outFile, offset);
+    } else {
+        writeHexFile(info, outFile);
+    }
+    outFile.close();
+    if (outFile.fail()) {
+        throwFileError("Error writing file", fileName);
+    }
+    out << std::format("HEX file written: {}, rebased by {}0x{:X}{}\n", fileName,
+        offset < 0 ? "-" : "", offset < 0 ? -offset : offset,
+        rewriteRecords ? "" : " (re-encoded)");
+}
+
+// CRC insertion
+// With --insert-crc, the length and CRC-32 of a range of the image are stored
+// at the given address as two little-endian 32-bit values, for the bootloader
+// to check. Gaps in the range count as the fill byte. The output hex file is a
+// copy of the input with only the records holding those 8 bytes re-encoded.
+
+const unsigned crcInfoSize = 8;
+
+// crc32Table - Table for the CRC-32 used by zlib and Ethernet (reflected polynomial 0xEDB88320)
+static constexpr std::array<uint32_t, 256> crc32Table = [] {
+    std::array<uint32_t, 256> table = {};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+// updateCrc32 - Add data to a CRC-32 calculation (which starts with 0xFFFFFFFF)
+static uint32_t updateCrc32(uint32_t crc, std::span<const unsigned char> data)
+{
+    for (unsigned char byte : data) {
+        crc = (crc >> 8) ^ crc32Table[(crc ^ byte) & 0xFF];
+    }
+    return crc;
+}
+
+static uint32_t updateCrc32(uint32_t crc, unsigned char fill, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; ++i) {
+        crc = (crc >> 8) ^ crc32Table[(crc ^ fill) & 0xFF];
+    }
+    return crc;
+}
+
+// computeRangeCrc - Calculate the CRC-32 of the image data from start to end,
+// with any gaps filled
+static uint32_t computeRangeCrc(const ImageInfo& info, unsigned start, uint64_t end, unsigned char fill)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint64_t address = start;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        uint64_t chunkEnd = uint64_t(chunk.address) + chunk.size;
+        if (chunkEnd <= address) {
+            continue;
+        }
+        if (chunk.address >= end) {
+            break;
+        }
+        if (chunk.address > address) {
+            crc = updateCrc32(crc, fill, chunk.address - address);
+            address = chunk.address;
+        }
+        uint64_t dataEnd = std::min(chunkEnd, end);
+        crc = updateCrc32(crc, std::span(chunk.data).subspan(size_t(address - chunk.address), size_t(dataEnd - address)));
+        address = dataEnd;
+    }
+    crc = updateCrc32(crc, fill, end - address);
+    return ~crc;
+}
+
+// insertCrcInfo - Store the length and CRC of the range in the image
+// Returns the bytes that were stored.
+static std::array<unsigned char, crcInfoSize> insertCrcInfo(ImageInfo& info, unsigned address, uint32_t length, uint32_t crc)
+{
+    std::array<unsigned char, crcInfoSize> bytes;
+    for (unsigned i = 0; i < 4; ++i) {
+        bytes[i] = static_cast<unsigned char>(length >> (8 * i));
+        bytes[4 + i] = static_cast<unsigned char>(crc >> (8 * i));
+    }
+    // The space must already be in the image, e.g. reserved in the image header.
+    // Where segments overlap, every segment that holds some of the bytes gets them.
+    std::array<bool, crcInfoSize> stored = {};
+    uint64_t end = uint64_t(address) + crcInfoSize;
+    for (Chunk& chunk : info.chunks) {
+        uint64_t start = std::max<uint64_t>(chunk.address, address);
+        uint64_t chunkEnd = std::min(uint64_t(chunk.address) + chunk.size, end);
+        for (uint64_t a = start; a < chunkEnd; ++a) {
+            chunk.data[size_t(a - chunk.address)] = bytes[size_t(a - address)];
+            stored[size_t(a - address)] = true;
+        }
+    }
+    if (!std::ranges::all_of(stored, std::identity{})) {
+        throwError(std::format("No data at CRC address 0x{:X}", address).c_str());
+    }
+    return bytes;
+}
+
+// insertCrcHexText - Copy a hex file, re-encoding the data records that hold
+// the bytes at the given address
+// The text must already have been validated and must not contain segment address records.
+static void insertCrcHexText(std::string_view text, std::ostream& output, unsigned address, std::span<const unsigned char> bytes)
+{
+    const unsigned dataOffset = 1 + 2 + 4 + 2; // ':' + count + address + type
+    uint64_t bytesEnd = uint64_t(address) + bytes.size();
+    unsigned baseAddress = 0;
+    size_t copyStart = 0;
+    for (size_t pos = 0; pos < text.size();) {
+        size_t eol = text.find('\n', pos);
+        size_t next = (eol == text.npos) ? text.size() : eol + 1;
+        std::string_view line = text.substr(pos, next - pos);
+        std::string_view lineEnd = line.substr(line.find_last_not_of("\r\n") + 1);
+        line.remove_suffix(lineEnd.size());
+        std::string_view type = line.substr(7, 2);
+        if (type == "04") {
+            baseAddress = fromHex(line.substr(dataOffset, 4)) << 16;
+        } else if (type == "00") {
+            unsigned recordAddress = baseAddress + fromHex(line.substr(3, 4));
+            unsigned size = fromHex(line.substr(1, 2));
+            uint64_t recordEnd = uint64_t(recordAddress) + size;
+            if (recordAddress < bytesEnd && address < recordEnd) {
+                std::vector<unsigned char> data(size);
+                for (unsigned i = 0; i < size; ++i) {
+                    data[i] = static_cast<unsigned char>(fromHex(line.substr(dataOffset + 2 * i, 2)));
+                }
+                for (uint64_t a = std::max<uint64_t>(recordAddress, address); a < std::min(recordEnd, bytesEnd); ++a) {
+                    data[a - recordAddress] = bytes[a - address];
+                }
+                output.write(text.data() + copyStart, std::streamsize(pos - copyStart));
+                output << makeHexRecord(typeData, recordAddress, data) << (lineEnd.empty() ? "\n" : lineEnd);
+                copyStart = next;
+            }
+        }
+        pos = next;
+    }
+    output.write(text.data() + copyStart, std::streamsize(text.size() - copyStart));
+}
+
+// applyCrcInsertion - Insert the length and CRC of the range into the image,
+// and write the output hex file if there is one
+static void applyCrcInsertion(ImageInfo& info, std::string_view text, std::ostream& out)
+{
+    uint32_t length = uint32_t(crcRangeEnd - crcRangeStart);
+    uint32_t crc = computeRangeCrc(info, crcRangeStart, crcRangeEnd, crcFill);
+    auto bytes = insertCrcInfo(info, crcAddress, length, crc);
+    out << std::format("CRC-32 of 0x{:08X}-0x{:08X}: 0x{:08X}, length 0x{:X}, inserted at 0x{:08X}\n",
+        crcRangeStart, crcRangeEnd - 1, crc, length, crcAddress);
+    if (outFileName.empty()) {
+        return;
+    }
+    bool rewriteRecords = !text.empty() && !info.hasSegmentRecords;
+    std::ofstream outFile(outFileName, std::ios::out);
+    if (outFile.fail()) {
+        throwFileError("Failed to create file", outFileName);
+    }
+    if (rewriteRecords) {
+        insertCrcHexText(text, outFile, crcAddress, bytes);
+    } else {
+        writeHexFile(info, outFile);
+    }
+    outFile.close();
+    if (outFile.fail()) {
+        throwFileError("Error writing file", outFileName);
+    }
+    out << std::format("HEX file written: {}{}\n", outFileName, rewriteRecords ? "" : " (re-encoded)");
+}
+
+// writeUf2File - Write the image data to a UF2 file
+// Data is split into 256-byte-aligned blocks. Any part of a block that isn't
+// covered by the data is filled with 0, and pages with no data are skipped.
+static void writeUf2File(const ImageInfo& info, const std::string& fileName, unsigned familyId, std::ostream& out)
+{
+    // Overlapping records make overlapping segments, which would put blocks for
+    // the same addresses in the file more than once.
+    if (info.numOverlapping > 0) {
+        throwError("Cannot write a UF2 file from overlapping data");
+    }
+    // Make a list of the pages that contain data, in order of address, along
+    // with the first chunk in each page, so the blocks can be filled in independently.
+    std::vector<const Chunk*> chunks;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        chunks.push_back(&chunk);
+    }
+    struct Page
+    {
+        unsigned address;
+        size_t iChunk;
+    };
+    std::vector<Page> pages;
+    for (size_t iChunk = 0; iChunk < chunks.size(); ++iChunk) {
+        uint64_t chunkEnd = uint64_t(chunks[iChunk]->address) + chunks[iChunk]->size;
+        for (uint64_t page = chunks[iChunk]->address & ~(uf2PayloadSize - 1); page < chunkEnd; page += uf2PayloadSize) {
+            // A page may already have been started by the previous chunk.
+            if (pages.empty() || pages.back().address < page) {
+                pages.push_back({ unsigned(page), iChunk });
+            }
+        }
+    }
+    TraceSpan span("build UF2 blocks", fileName);
+    std::vector<Uf2Block, CountingAllocator<Uf2Block, memOutputBuffer>> blocks(pages.size());
+    parallelFor(pages.size(), 64, [&](size_t iBlock) {
+        const Page& page = pages[iBlock];
+        Uf2Block& block = blocks[iBlock];
+        block.magicStart0 = uf2MagicStart0;
+        block.magicStart1 = uf2MagicStart1;
+        block.flags = uf2FlagFamilyIdPresent;
+        block.targetAddr = page.address;
+        block.payloadSize = uf2PayloadSize;
+        block.blockNo = uint32_t(iBlock);
+        block.numBlocks = uint32_t(pages.size());
+        block.familyId = familyId;
+        block.magicEnd = uf2MagicEnd;
+        uint64_t pageEnd = uint64_t(page.address) + uf2PayloadSize;
+        for (size_t iChunk = page.iChunk; iChunk < chunks.size() && chunks[iChunk]->address < pageEnd; ++iChunk) {
+            const Chunk& chunk = *chunks[iChunk];
+            uint64_t start = std::max<uint64_t>(chunk.address, page.address);
+            uint64_t end = std::min(uint64_t(chunk.address) + chunk.size, pageEnd);
+            if (start < end) {
+                std::memcpy(block.data + (start - page.address),
+                    chunk.data.data() + (start - chunk.address), end - start);
+            }
+        }
+    });
+    span.end();
+    std::ofstream outFile(fileName, std::ios::out | std::ios::binary);
+    if (outFile.fail()) {
+        throwFileError("Failed to create file", fileName);
+    }
+    outFile.write(reinterpret_cast<const char*>(blocks.data()), std::streamsize(blocks.size() * sizeof(Uf2Block)));
+    outFile.close();
+    if (outFile.fail()) {
+        throwFileError("Error writing file", fileName);
+    }
+    out << std::format("UF2 file written: {}, {} blocks, family ID 0x{:08X}\n",
+        fileName, blocks.size(), familyId);
+}
+
+// Image handoff
+// With --memfd, the decoded image is put in a sealed memfd and the fd is sent
+// over a Unix socket, so another process (e.g. a flasher) can map the data
+// without copying or parsing it again. The memfd contains a MemfdHeader, then
+// a MemfdSegment for each data segment in order of address, then the data of
+// each segment, at 16-byte-aligned offsets. All values are native-endian.
+
+struct MemfdHeader
+{
+    char magic[8]; // "HEXIMG\0\0"
+    uint32_t version;
+    uint32_t numSegments;
+    uint32_t startAddress;
+    uint32_t hasStartAddress;
+    uint64_t totalSize; // of the memfd
+};
+
+struct MemfdSegment
+{
+    uint32_t address;
+    uint32_t size;
+    uint64_t offset; // of the data in the memfd
+};
+
+const char memfdMagic[8] = { 'H', 'E', 'X', 'I', 'M', 'G', 0, 0 };
+const uint32_t memfdVersion = 1;
+
+#ifdef __linux__
+// makeImageMemfd - Make a sealed memfd containing the image data
+static int makeImageMemfd(const ImageInfo& info)
+{
+    auto align = [](uint64_t offset) { return (offset + 15) & ~uint64_t(15); };
+    MemfdHeader header = {};
+    std::memcpy(header.magic, memfdMagic, sizeof(header.magic));
+    header.version = memfdVersion;
+    header.numSegments = unsigned(info.chunks.size());
+    header.startAddress = info.startAddress;
+    header.hasStartAddress = (info.numStartAddresses > 0);
+    std::vector<MemfdSegment> segments;
+    uint64_t offset = align(sizeof(MemfdHeader) + info.chunks.size() * sizeof(MemfdSegment));
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        segments.push_back({ chunk.address, chunk.size, offset });
+        offset = align(offset + chunk.size);
+    }
+    header.totalSize = offset;
+    int fd = memfd_create("hexfileinfo-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        throwError("Failed to create memfd");
+    }
+    try {
+        if (ftruncate(fd, off_t(header.totalSize)) != 0) {
+            throwError("Failed to create memfd");
+        }
+        // The data is written through a mapping, which must be gone before F_SEAL_WRITE.
+        void* mapping = mmap(nullptr, header.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            throwError("Failed to map memfd");
+        }
+        auto data = static_cast<unsigned char*>(mapping);
+        std::memcpy(data, &header, sizeof(header));
+        std::memcpy(data + sizeof(header), segments.data(), segments.size() * sizeof(MemfdSegment));
+        size_t iSegment = 0;
+        for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+            std::memcpy(data + segments[iSegment++].offset, chunk.data.data(), chunk.size);
+        }
+        munmap(mapping, header.totalSize);
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            throwError("Failed to seal memfd");
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    return fd;
+}
+
+// sendImageMemfd - Send the image in a memfd to the process listening on a Unix socket
+// The message is the size of the memfd, with the fd attached (SCM_RIGHTS).
+static void sendImageMemfd(const ImageInfo& info, const std::string& socketName, std::ostream& out)
+{
+    // Overlapping records make overlapping segments, and a receiver that writes
+    // each segment would write the same addresses more than once.
+    if (info.numOverlapping > 0) {
+        throwError("Cannot hand off overlapping data");
+    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socketName.size() >= sizeof(addr.sun_path)) {
+        throwFileError("Socket name too long", socketName);
+    }
+    std::memcpy(addr.sun_path, socketName.c_str(), socketName.size() + 1);
+    int imageFd = makeImageMemfd(info);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ok = sock >= 0 && connect(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+    uint64_t totalSize = 0;
+    if (ok) {
+        struct stat st;
+        fstat(imageFd, &st);
+        totalSize = uint64_t(st.st_size);
+        iovec iov = { &totalSize, sizeof(totalSize) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &imageFd, sizeof(int));
+        ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == ssize_t(sizeof(totalSize));
+    }
+    if (sock >= 0) {
+        ::close(sock);
+    }
+    ::close(imageFd);
+    if (!ok) {
+        throwFileError("Failed to send image to socket", socketName);
+    }
+    out << std::format("Image sent to {}: {} segments, {} bytes\n", socketName, info.chunks.size(), totalSize);
+}
+#endif
+
+// Linker map files
+// GNU ld map files (-Map) and LLVM lld map files (--Map) are supported. Sections
+// are placed by their load address, because that's where they are in the hex file.
+
+// MapSection - An output section from a map file
+struct MapSection
+{
+    std::string name;
+    uint64_t address; // load address
+    uint64_t size;
+    uint64_t vma;
+};
+
+// MapEntry - A range of addresses belonging to a symbol, or to the part of an
+// input section that has no symbol
+struct MapEntry
+{
+    uint64_t address; // load address
+    uint64_t size;
+    std::string name;
+    std::string source;
+};
+
+struct MapFile
+{
+    std::vector<MapSection> sections; // in order of address
+    std::vector<MapEntry> entries; // in order of address
+};
+
+// parseMapNumber - Parse a hex number in a map file, with or without 0x prefix
+static bool parseMapNumber(std::string_view str, uint64_t& n)
+{
+    if (str.starts_with("0x") || str.starts_with("0X")) {
+        str.remove_prefix(2);
+    }
+    auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), n, 16);
+    return !str.empty() && ec == std::errc() && end == str.data() + str.size();
+}
+
+static bool isMapNumber(std::string_view str)
+{
+    uint64_t n;
+    return parseMapNumber(str, n);
+}
+
+// isLoadedSection - Check whether a section is expected to have data in the image
+// Sections that are zero-filled, uninitialized, or not loaded at all are not.
+static bool isLoadedSection(std::string_view name)
+{
+    const char* notLoaded[] = { ".bss", ".tbss", ".noinit", ".heap", ".stack", ".comment",
+        ".debug", ".stab", ".ARM.attributes", ".riscv.attributes", ".gnu.attributes", ".note.GNU-stack" };
+    return std::ranges::none_of(notLoaded, [name](const char* prefix) { return name.starts_with(prefix); });
+}
+
+static std::vector<std::string_view> splitWords(std::string_view line)
+{
+    std::vector<std::string_view> words;
+    size_t pos = 0;
+    while ((pos = line.find_first_not_of(" \t\r", pos)) != line.npos) {
+        size_t end = std::min(line.find_first_of(" \t\r", pos), line.size());
+        words.push_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+    return words;
+}
+
+// MapBuilder - Collects sections and symbols while a map file is parsed
+// Sections that aren't loaded (debug info etc.) are left out, with everything in
+// them, since they often overlap the loaded ones at address 0. Each symbol
+// belongs to the input section it's listed under.
+struct MapBuilder
+{
+    struct InputSection
+    {
+        uint64_t address;
+        uint64_t size;
+        std::string name;
+        size_t firstSymbol; // index of its first symbol in symbols
+    };
+    struct Symbol
+    {
+        uint64_t address;
+        std::string name;
+    };
+    MapFile map;
+    std::vector<InputSection> inputSections;
+    std::vector<Symbol> symbols;
+    uint64_t lmaOffset = 0; // LMA - VMA of the current output section
+    bool inLoadedSection = false;
+    bool inInputSection = false;
+
+    void addSection(std::string_view name, uint64_t vma, uint64_t size, uint64_t lma)
+    {
+        inLoadedSection = isLoadedSection(name);
+        inInputSection = false;
+        if (inLoadedSection) {
+            map.sections.push_back({ std::string(name), lma, size, vma });
+            lmaOffset = lma - vma;
+        }
+    }
+    void addInputSection(std::string name, uint64_t vma, uint64_t size)
+    {
+        inInputSection = (inLoadedSection && size > 0);
+        if (inInputSection) {
+            inputSections.push_back({ vma + lmaOffset, size, std::move(name), symbols.size() });
+        }
+    }
+    void addSymbol(std::string_view name, uint64_t vma)
+    {
+        if (inInputSection) {
+            symbols.push_back({ vma + lmaOffset, std::string(name) });
+        }
+    }
+
+    // finish - Divide each input section between the symbols in it
+    MapFile finish()
+    {
+        auto byAddress = [](const auto& a, const auto& b) { return a.address < b.address; };
+        for (size_t iSection = 0; iSection < inputSections.size(); ++iSection) {
+            const InputSection& section = inputSections[iSection];
+            uint64_t end = section.address + section.size;
+            size_t endSymbol = (iSection + 1 < inputSections.size()) ? inputSections[iSection + 1].firstSymbol : symbols.size();
+            auto sectionSymbols = std::span(symbols).subspan(section.firstSymbol, endSymbol - section.firstSymbol);
+            std::ranges::stable_sort(sectionSymbols, byAddress);
+            auto iter = std::ranges::lower_bound(sectionSymbols, section.address, {}, &Symbol::address);
+            uint64_t address = section.address;
+            std::string name = section.name;
+            for (; iter != sectionSymbols.end() && iter->address < end; ++iter) {
+                if (iter->address > address) {
+                    map.entries.push_back({ address, iter->address - address, std::move(name), section.name });
+                }
+                address = iter->address;
+                name = iter->name;
+            }
+            map.entries.push_back({ address, end - address, std::move(name), section.name });
+        }
+        std::ranges::stable_sort(map.sections, byAddress);
+        std::ranges::stable_sort(map.entries, byAddress);
+        return std::move(map);
+    }
+};
+
+// parseGnuMap - Parse the memory map part of a GNU ld map file
+static void parseGnuMap(std::string_view text, MapBuilder& builder)
+{
+    size_t start = text.find("Linker script and memory map");
+    size_t pos = (start == text.npos) ? 0 : start;
+    // Long section names are on a line by themselves, followed by the numbers.
+    std::string_view pendingName;
+    bool pendingOutput = false;
+    while (pos < text.size()) {
+        size_t next = std::min(text.find('\n', pos), text.size());
+        std::string_view line = text.substr(pos, next - pos);
+        pos = next + 1;
+        if (line.starts_with("OUTPUT(") || line.starts_with("Cross Reference Table")) {
+            break;
+        }
+        std::vector<std::string_view> words = splitWords(line);
+        bool indented = line.starts_with(' ') || line.starts_with('\t');
+        if (words.empty()) {
+            continue;
+        }
+        if (!pendingName.empty() && isMapNumber(words[0])) {
+            words.insert(words.begin(), pendingName);
+            indented = !pendingOutput;
+        }
+        pendingName = {};
+        if (words.size() == 1 && !words[0].starts_with('*') && !isMapNumber(words[0])) {
+            pendingName = words[0];
+            pendingOutput = !indented;
+            continue;
+        }
+        uint64_t address, size;
+        if (words.size() >= 3 && parseMapNumber(words[1], address) && parseMapNumber(words[2], size)) {
+            if (!indented) {
+                // Output section, possibly with a separate load address
+                uint64_t lma = address;
+                if (words.size() >= 6 && words[3] == "load" && words[4] == "address") {
+                    parseMapNumber(words[5], lma);
+                }
+                builder.addSection(words[0], address, size, lma);
+            } else if (!words[0].starts_with('*')) {
+                // Input section, named after the object file it comes from
+                std::string name = (words.size() > 3)
+                    ? std::format("{}({})", words[3], words[0]) : std::string(words[0]);
+                builder.addInputSection(std::move(name), address, size);
+            }
+        } else if (indented && words.size() == 2 && words[0].starts_with("0x") && parseMapNumber(words[0], address)
+            && !words[1].starts_with("0x")) {
+            // Symbol: an address and a name, which can look like a hex number
+            // (assignments in the linker script have more words and are ignored)
+            builder.addSymbol(words[1], address);
+        }
+    }
+}
+
+// parseLldMap - Parse an LLVM lld map file
+// The header line gives the columns, and the indentation of the name tells
+// whether a line is an output section, input section, or symbol.
+static void parseLldMap(std::string_view text, MapBuilder& builder)
+{
+    size_t pos = text.find('\n');
+    std::string_view header = text.substr(0, pos);
+    std::vector<std::string_view> columns = splitWords(header);
+    auto findColumn = [&](std::string_view name) {
+        return std::ranges::find(columns, name) - columns.begin();
+    };
+    auto iVma = findColumn(columns[0] == "Address" ? "Address" : "VMA");
+    auto iLma = findColumn("LMA");
+    auto iSize = findColumn("Size");
+    auto numNumbers = findColumn("Out");
+    size_t outPos = header.find("Out");
+    size_t inPos = header.find("In");
+    size_t symbolPos = header.find("Symbol");
+    if (iSize >= numNumbers || numNumbers >= std::ssize(columns) || outPos == header.npos || inPos == header.npos || symbolPos == header.npos) {
+        throwError("Unrecognized map file format");
+    }
+    while (pos < text.size()) {
+        pos += 1;
+        size_t next = std::min(text.find('\n', pos), text.size());
+        std::string_view line = text.substr(pos, next - pos);
+        pos = next;
+        std::vector<std::string_view> words = splitWords(line);
+        uint64_t vma, lma, size;
+        if (std::ssize(words) <= numNumbers || !parseMapNumber(words[iVma], vma) || !parseMapNumber(words[iSize], size)) {
+            continue;
+        }
+        if (iLma >= numNumbers || !parseMapNumber(words[iLma], lma)) {
+            lma = vma;
+        }
+        // The name is everything after the numbers; its position gives its kind.
+        std::string_view lastNumber = words[numNumbers - 1];
+        size_t namePos = line.find_first_not_of(" \t", lastNumber.data() + lastNumber.size() - line.data());
+        if (namePos == line.npos) {
+            continue;
+        }
+        std::string_view name = line.substr(namePos);
+        if (name.ends_with('\r')) {
+            name.remove_suffix(1);
+        }
+        if (namePos < inPos) {
+            builder.addSection(name, vma, size, lma);
+        } else if (namePos < symbolPos) {
+            builder.addInputSection(std::string(name), vma, size);
+        } else {
+            builder.addSymbol(name, vma);
+        }
+    }
+}
+
+static MapFile loadMapFile(const std::string& fileName)
+{
+    std::ifstream mapFile(fileName, std::ios::in | std::ios::binary);
+    if (mapFile.fail()) {
+        throwFileError("Failed to open file", fileName);
+    }
+    ReadBuffer text(std::istreambuf_iterator<char>(mapFile), {});
+    if (mapFile.bad()) {
+        throwFileError("Error reading file", fileName);
+    }
+    MapBuilder builder;
+    std::string_view firstLine = std::string_view(text).substr(0, text.find('\n'));
+    std::vector<std::string_view> columns = splitWords(firstLine);
+    if (!columns.empty() && (columns[0] == "VMA" || columns[0] == "Address")) {
+        parseLldMap(text, builder);
+    } else {
+        parseGnuMap(text, builder);
+    }
+    return builder.finish();
+}
+
+// forEachOverlap - Call func(item, bytes) with the number of image bytes in
+// each item of a list of address ranges that is sorted by address
+// This is a merge of the two sorted lists, so it's linear in their sizes.
+static void forEachOverlap(const std::vector<const Chunk*>& chunks, const auto& items, const auto& func)
+{
+    size_t iFirst = 0;
+    for (const auto& item : items) {
+        uint64_t itemEnd = item.address + item.size;
+        while (iFirst < chunks.size() && uint64_t(chunks[iFirst]->address) + chunks[iFirst]->size <= item.address) {
+            ++iFirst;
+        }
+        uint64_t bytes = 0;
+        for (size_t iChunk = iFirst; iChunk < chunks.size() && chunks[iChunk]->address < itemEnd; ++iChunk) {
+            uint64_t start = std::max<uint64_t>(chunks[iChunk]->address, item.address);
+            uint64_t end = std::min(uint64_t(chunks[iChunk]->address) + chunks[iChunk]->size, itemEnd);
+            bytes += (end > start) ? end - start : 0;
+        }
+        func(item, bytes);
+    }
+}
+
+// printMapInfo - Show which sections and symbols the image data belongs to
+static void printMapInfo(const ImageInfo& info, const MapFile& map, const std::string& mapFileName, std::ostream& out)
+{
+    const size_t maxSymbols = 20;
+    std::vector<const Chunk*> chunks;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        chunks.push_back(&chunk);
+    }
+    out << std::format("Map file: {}, {} sections, {} symbols\n", mapFileName, map.sections.size(), map.entries.size());
+    out << "Bytes in image by section:\n";
+    std::vector<const MapSection*> missing;
+    forEachOverlap(chunks, map.sections, [&](const MapSection& section, uint64_t bytes) {
+        if (bytes > 0) {
+            out << std::format("{} 0x{:X} of 0x{:X}", section.name, bytes, section.size);
+            if (section.address != section.vma) {
+                out << std::format(" (load address 0x{:X})", section.address);
+            }
+            out << "\n";
+        } else if (section.size > 0) {
+            missing.push_back(&section);
+        }
+    });
+    if (!missing.empty()) {
+        out << "Sections not in image:\n";
+        for (const MapSection* section : missing) {
+            out << std::format("{} start 0x{:X} size 0x{:X}\n", section->name, section->address, section->size);
+        }
+    }
+    struct SymbolBytes
+    {
+        const MapEntry* entry;
+        uint64_t bytes;
+    };
+    std::vector<SymbolBytes> symbols;
+    forEachOverlap(chunks, map.entries, [&](const MapEntry& entry, uint64_t bytes) {
+        if (bytes > 0) {
+            symbols.push_back({ &entry, bytes });
+        }
+    });
+    size_t numShown = std::min(symbols.size(), maxSymbols);
+    std::ranges::partial_sort(symbols, symbols.begin() + numShown, std::ranges::greater{}, &SymbolBytes::bytes);
+    out << std::format("Largest symbols in image ({} of {}):\n", numShown, symbols.size());
+    for (const SymbolBytes& symbol : std::span(symbols).first(numShown)) {
+        out << std::format("0x{:X} {}", symbol.bytes, symbol.entry->name);
+        if (symbol.entry->name != symbol.entry->source) {
+            out << std::format(" in {}", symbol.entry->source);
+        }
+        out << "\n";
+    }
+    // Find image data that's outside all sections.
+    std::vector<Chunk> unmapped;
+    size_t iSection = 0;
+    for (const Chunk* chunk : chunks) {
+        uint64_t address = chunk->address;
+        uint64_t chunkEnd = address + chunk->size;
+        while (iSection < map.sections.size() && map.sections[iSection].address + map.sections[iSection].size <= address) {
+            ++iSection;
+        }
+        for (size_t i = iSection; i < map.sections.size() && map.sections[i].address < chunkEnd; ++i) {
+            if (map.sections[i].address > address) {
+                unmapped.push_back({ unsigned(address), unsigned(map.sections[i].address - address), {} });
+            }
+            address = std::max(address, map.sections[i].address + map.sections[i].size);
+        }
+        if (address < chunkEnd) {
+            unmapped.push_back({ unsigned(address), unsigned(chunkEnd - address), {} });
+        }
+    }
+    if (!unmapped.empty()) {
+        out << std::format("{} unmapped data segments:\n", unmapped.size());
+        for (const Chunk& chunk : unmapped) {
+            out << std::format("start 0x{:X} size 0x{:X}\n", chunk.address, chunk.size);
+        }
+    }
+}
+
+// byteEntropy - Calculate the Shannon entropy of some data, in bits per byte
+static double byteEntropy(std::span<const unsigned char> bytes)
+{
+    // Count the byte values in 4 separate tables, so a run of identical bytes
+    // doesn't make each increment wait for the previous one.
+    uint32_t counts[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= bytes.size(); i += 4) {
+        ++counts[0][bytes[i]];
+        ++counts[1][bytes[i + 1]];
+        ++counts[2][bytes[i + 2]];
+        ++counts[3][bytes[i + 3]];
+    }
+    for (; i < bytes.size(); ++i) {
+        ++counts[0][bytes[i]];
+    }
+    double entropy = 0;
+    for (unsigned value = 0; value < 256; ++value) {
+        uint32_t count = counts[0][value] + counts[1][value] + counts[2][value] + counts[3][value];
+        if (count > 0) {
+            double p = double(count) / double(bytes.size());
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+// printEntropyInfo - Show the entropy of each data segment, page by page,
+// and any pages whose entropy is outside the given range
+static void printEntropyInfo(const ImageInfo& info, unsigned pageSize, double minEntropy, double maxEntropy,
+    std::ostream& out)
+{
+    struct Page
+    {
+        const Chunk* chunk;
+        unsigned offset;
+        unsigned size;
+        double entropy;
+    };
+    // Pages are aligned on multiples of the page size, so the first and last
+    // pages of a segment may be partial.
+    std::vector<Page> pages;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        for (unsigned offset = 0; offset < chunk.size;) {
+            unsigned size = std::min(pageSize - (chunk.address + offset) % pageSize, chunk.size - offset);
+            pages.push_back({ &chunk, offset, size, 0 });
+            offset += size;
+        }
+    }
+    parallelFor(pages.size(), 16, [&pages](size_t iPage) {
+        Page& page = pages[iPage];
+        page.entropy = byteEntropy(std::span(page.chunk->data).subspan(page.offset, page.size));
+    });
+    out << std::format("Entropy in bits per byte, 0x{:X}-byte pages:\n", pageSize);
+    for (auto iPage = pages.begin(); iPage != pages.end();) {
+        const Chunk* chunk = iPage->chunk;
+        auto iEnd = std::find_if(iPage, pages.end(), [chunk](const Page& page) { return page.chunk != chunk; });
+        auto [iMin, iMax] = std::minmax_element(iPage, iEnd,
+            [](const Page& a, const Page& b) { return a.entropy < b.entropy; });
+        double mean = 0;
+        for (auto iter = iPage; iter != iEnd; ++iter) {
+            mean += iter->entropy * iter->size;
+        }
+        mean /= chunk->size;
+        out << std::format("start 0x{:X} size 0x{:X}: {} pages, min {:.2f} mean {:.2f} max {:.2f}\n",
+            chunk->address, chunk->size, iEnd - iPage, iMin->entropy, mean, iMax->entropy);
+        // Show runs of consecutive pages that are out of range.
+        while (iPage != iEnd) {
+            bool isLow = iPage->entropy < minEntropy;
+            bool isHigh = iPage->entropy > maxEntropy;
+            auto iRunEnd = std::find_if(iPage, iEnd, [&](const Page& page) {
+                return (page.entropy < minEntropy) != isLow || (page.entropy > maxEntropy) != isHigh;
+            });
+            if (isLow || isHigh) {
+                unsigned runSize = 0;
+                for (auto iter = iPage; iter != iRunEnd; ++iter) {
+                    runSize += iter->size;
+                }
+                out << std::format("  start 0x{:X} size 0x{:X}: entropy {} {:.2f}\n",
+                    chunk->address + iPage->offset, runSize,
+                    isLow ? "below" : "above", isLow ? minEntropy : maxEntropy);
+            }
+            iPage = iRunEnd;
+        }
+    }
+}
+
+// Image verification
+// With --verify, the image is compared with a golden image, except in the
+// --ignore ranges (serial numbers, calibration data, etc. that differ on each
+// unit). The ignored ranges are made into a byte mask for each block of
+// addresses that's ANDed into the comparison, so the data is compared a word
+// at a time however many ranges are ignored.
+
+enum differenceType_t {
+    diffData, // data differs
+    diffMissing, // data is only in the golden image
+    diffExtra // data is only in this image
+};
+
+// DifferenceList - The differences found, merged into ranges
+class DifferenceList
+{
+public:
+    struct Difference
+    {
+        unsigned address;
+        uint64_t size;
+        differenceType_t type;
+    };
+
+    void add(unsigned address, uint64_t size, differenceType_t type)
+    {
+        numBytes += size;
+        if (!differences.empty()) {
+            Difference& last = differences.back();
+            if (last.type == type && last.address + last.size == address) {
+                last.size += size;
+                return;
+            }
+        }
+        differences.push_back({ address, size, type });
+    }
+
+    // addUnmasked - Add the parts of a range that aren't ignored
+    void addUnmasked(unsigned start, uint64_t end, differenceType_t type)
+    {
+        uint64_t address = start;
+        auto iter = std::ranges::upper_bound(ignoreRanges, address, {}, &AddressRange::end);
+        for (; iter != ignoreRanges.end() && iter->start < end; ++iter) {
+            if (iter->start > address) {
+                add(unsigned(address), iter->start - address, type);
+            }
+            address = iter->end;
+        }
+        if (address < end) {
+            add(unsigned(address), end - address, type);
+        }
+    }
+
+    std::vector<Difference> differences;
+    uint64_t numBytes = 0;
+};
+
+const unsigned compareBlockSize = 0x1000;
+
+// makeCompareMask - Make the mask for a block of addresses, 0xFF for bytes to
+// compare and 0 for bytes to ignore
+// Returns false if the whole block is ignored.
+static bool makeCompareMask(unsigned start, unsigned size, unsigned char* mask)
+{
+    std::fill_n(mask, size, 0xFF);
+    uint64_t end = uint64_t(start) + size;
+    auto iter = std::ranges::upper_bound(ignoreRanges, uint64_t(start), {}, &AddressRange::end);
+    for (; iter != ignoreRanges.end() && iter->start < end; ++iter) {
+        uint64_t maskStart = std::max<uint64_t>(iter->start, start);
+        uint64_t maskEnd = std::min(iter->end, end);
+        if (maskStart == start && maskEnd == end) {
+            return false;
+        }
+        std::fill(mask + (maskStart - start), mask + (maskEnd - start), 0);
+    }
+    return true;
+}
+
+// compareMasked - Compare data at the same addresses in the two images
+static void compareMasked(unsigned start, uint64_t size, const unsigned char* data, const unsigned char* golden,
+    DifferenceList& differences)
+{
+    alignas(8) unsigned char mask[compareBlockSize];
+    auto load = [](const unsigned char* p) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        return word;
+    };
+    for (uint64_t offset = 0; offset < size;) {
+        unsigned blockSize = unsigned(std::min<uint64_t>(compareBlockSize - (start + offset) % compareBlockSize, size - offset));
+        const unsigned char* a = data + offset;
+        const unsigned char* b = golden + offset;
+        if (makeCompareMask(unsigned(start + offset), blockSize, mask)) {
+            // 32 bytes at a time, which the compiler can vectorize
+            unsigned i = 0;
+            for (; i + 32 <= blockSize; i += 32) {
+                uint64_t diff = 0;
+                for (unsigned j = 0; j < 32; j += 8) {
+                    diff |= (load(a + i + j) ^ load(b + i + j)) & load(mask + i + j);
+                }
+                if (diff != 0) {
+                    for (unsigned j = i; j < i + 32; ++j) {
+                        if ((a[j] ^ b[j]) & mask[j]) {
+                            differences.add(unsigned(start + offset + j), 1, diffData);
+                        }
+                    }
+                }
+            }
+            for (; i < blockSize; ++i) {
+                if ((a[i] ^ b[i]) & mask[i]) {
+                    differences.add(unsigned(start + offset + i), 1, diffData);
+                }
+            }
+        }
+        offset += blockSize;
+    }
+}
+
+// compareImages - Find the differences between an image and the golden image
+// outside the ignored ranges
+static DifferenceList compareImages(const ImageInfo& info, const ImageInfo& golden)
+{
+    DifferenceList differences;
+    auto chunks = std::ranges::reverse_view(info.chunks);
+    auto goldenChunks = std::ranges::reverse_view(golden.chunks);
+    auto iChunk = chunks.begin();
+    auto iGolden = goldenChunks.begin();
+    auto chunkEnd = [](const Chunk& chunk) { return uint64_t(chunk.address) + chunk.size; };
+    const uint64_t noAddress = uint64_t(1) << 32;
+    // Go through the address space one span at a time, where each span is in
+    // both images or only one.
+    uint64_t address = 0;
+    for (;;) {
+        while (iChunk != chunks.end() && chunkEnd(*iChunk) <= address) {
+            ++iChunk;
+        }
+        while (iGolden != goldenChunks.end() && chunkEnd(*iGolden) <= address) {
+            ++iGolden;
+        }
+        uint64_t dataStart = (iChunk != chunks.end()) ? std::max<uint64_t>(iChunk->address, address) : noAddress;
+        uint64_t goldenStart = (iGolden != goldenChunks.end()) ? std::max<uint64_t>(iGolden->address, address) : noAddress;
+        uint64_t start = std::min(dataStart, goldenStart);
+        if (start == noAddress) {
+            break;
+        }
+        bool inData = (dataStart == start);
+        bool inGolden = (goldenStart == start);
+        uint64_t end = std::min(inData ? chunkEnd(*iChunk) : dataStart, inGolden ? chunkEnd(*iGolden) : goldenStart);
+        if (inData && inGolden) {
+            compareMasked(unsigned(start), end - start, iChunk->data.data() + (start - iChunk->address),
+                iGolden->data.data() + (start - iGolden->address), differences);
+        } else {
+            differences.addUnmasked(unsigned(start), end, inData ? diffExtra : diffMissing);
+        }
+        address = end;
+    }
+    return differences;
+}
+
+// printVerifyInfo - Compare the image with the golden image, and show the differences
+// Returns false if there are any.
+static bool printVerifyInfo(const ImageInfo& info, const ImageInfo& golden, const std::string& goldenName,
+    std::ostream& out)
+{
+    const size_t maxDifferencesShown = 20;
+    DifferenceList differences = compareImages(info, golden);
+    if (differences.differences.empty()) {
+        out << std::format("Verified against {}{}\n", goldenName, ignoreRanges.empty() ? "" : " (with ignored ranges)");
+        return true;
+    }
+    out << std::format("Differences from {}: {} bytes in {} ranges\n", goldenName,
+        differences.numBytes, differences.differences.size());
+    static const char* const typeNames[] = { "data differs", "not in this image", "not in golden image" };
+    for (const auto& difference : differences.differences | std::views::take(maxDifferencesShown)) {
+        out << std::format("start 0x{:X} size 0x{:X}: {}\n", difference.address, difference.size, typeNames[difference.type]);
+    }
+    if (differences.differences.size() > maxDifferencesShown) {
+        out << std::format("... and {} more\n", differences.differences.size() - maxDifferencesShown);
+    }
+    return false;
+}
+
+// addIgnoreRange - Add a range to the ignored ranges, keeping them sorted and merged
+static void addIgnoreRange(unsigned start, uint64_t end)
+{
+    auto iter = std::ranges::lower_bound(ignoreRanges, uint64_t(start), {}, &AddressRange::end);
+    auto iEnd = iter;
+    AddressRange range{ start, end };
+    for (; iEnd != ignoreRanges.end() && iEnd->start <= end; ++iEnd) {
+        range.start = std::min(range.start, iEnd->start);
+        range.end = std::max(range.end, iEnd->end);
+    }
+    iter = ignoreRanges.erase(iter, iEnd);
+    ignoreRanges.insert(iter, range);
+}
+
+static void printImageInfo(const ImageInfo& info, std::ostream& out)
+{
+    if (!info.foundEof) {
+        out << (info.isUf2 ? "Missing UF2 blocks\n" : "Missing EOF record\n");
+    }
+    if (info.numStartAddresses > 1) {
+        out << "Multiple start addresses found\n";
+    } else if (info.numStartAddresses > 0) {
+        out << std::format("Start address: 0x{:X}\n", info.startAddress);
+    }
+    if (info.numFamilyIds > 1) {
+        out << "Multiple family IDs found\n";
+    } else if (info.numFamilyIds > 0) {
+        out << std::format("Family ID: 0x{:08X}\n", info.familyId);
+    }
+    out << std::format("{} {}, max size {}\n", info.numDataRecords,
+        info.isUf2 ? "UF2 blocks" : "data records", info.maxDataSize);
+    out << std::format("{} data segments", info.chunks.size());
+    if (info.numOverlapping > 0) {
+        out << std::format(", {} overlaps found", info.numOverlapping);
+    }
+    out << ":\n";
+    // Display the chunks in reverse order because they were added in reverse order.
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        out << std::format("start 0x{:X} size 0x{:X}\n", chunk.address, chunk.size);
+    }
+}
+
+// getPeakMemoryUsage - Get the peak resident set size of the process, in bytes
+static uint64_t getPeakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// printMemoryUsage - Show the high-water mark of each kind of memory used for a file
+static void printMemoryUsage(const MemoryUsage& usage, std::ostream& out)
+{
+    out << "Memory high-water marks:\n";
+    int64_t total = 0;
+    for (int i = 0; i < numMemoryCategories; ++i) {
+        int64_t peak = usage.peak[i].load();
+        out << std::format("  {:<16}{:>12} bytes\n", memoryCategoryNames[i], peak);
+        total += peak;
+    }
+    out << std::format("  {:<16}{:>12} bytes\n", "total", total);
+}
+
+// Metrics
+// With --metrics-file, totals for the run are written at the end in the
+// Prometheus text format, for the node_exporter textfile collector. Each
+// thread counts into its own Metrics, and they're only added up at the end.
+
+const double latencyBuckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60 }; // seconds
+
+struct Metrics
+{
+    uint64_t filesProcessed = 0;
+    uint64_t filesFailed = 0;
+    uint64_t inputBytes = 0;
+    uint64_t records[std::size(recordTypeNames)] = {};
+    uint64_t latencyCounts[std::size(latencyBuckets) + 1] = {}; // not cumulative; last is +Inf
+    double latencySum = 0;
+};
+
+static PerThread<Metrics> metricsShards;
+
+static void countFileMetrics(const ImageInfo& info, bool ok, double seconds)
+{
+    Metrics& metrics = metricsShards.get();
+    ++(ok ? metrics.filesProcessed : metrics.filesFailed);
+    metrics.inputBytes += info.inputSize;
+    for (size_t iType = 0; iType < std::size(metrics.records); ++iType) {
+        metrics.records[iType] += info.recordCounts[iType];
+    }
+    auto iBucket = std::ranges::lower_bound(latencyBuckets, seconds) - std::begin(latencyBuckets);
+    ++metrics.latencyCounts[iBucket];
+    metrics.latencySum += seconds;
+}
+
+// writeMetricsFile - Add up the metrics of all threads and write them
+// The file is written under a temporary name and then renamed, so the collector
+// never sees a partial file. This must only be called when no other threads are running.
+static void writeMetricsFile(const std::string& fileName, double runSeconds)
+{
+    Metrics total;
+    for (const Metrics& metrics : metricsShards.all()) {
+        total.filesProcessed += metrics.filesProcessed;
+        total.filesFailed += metrics.filesFailed;
+        total.inputBytes += metrics.inputBytes;
+        for (size_t iType = 0; iType < std::size(total.records); ++iType) {
+            total.records[iType] += metrics.records[iType];
+        }
+        for (size_t iBucket = 0; iBucket < std::size(total.latencyCounts); ++iBucket) {
+            total.latencyCounts[iBucket] += metrics.latencyCounts[iBucket];
+        }
+        total.latencySum += metrics.latencySum;
+    }
+    std::string text;
+    auto addMetric = [&text](const char* name, const char* type, const char* help) {
+        text += std::format("# HELP hexfileinfo_{} {}\n# TYPE hexfileinfo_{} {}\n", name, help, name, type);
+    };
+    addMetric("files_total", "counter", "Input files processed, by result.");
+    text += std::format("hexfileinfo_files_total{{result=\"ok\"}} {}\n", total.filesProcessed);
+    text += std::format("hexfileinfo_files_total{{result=\"failed\"}} {}\n", total.filesFailed);
+    addMetric("input_bytes_total", "counter", "Bytes read from input files.");
+    text += std::format("hexfileinfo_input_bytes_total {}\n", total.inputBytes);
+    addMetric("records_total", "counter", "Records read, by record type (UF2 blocks count as data).");
+    for (size_t iType = 0; iType < std::size(total.records); ++iType) {
+        text += std::format("hexfileinfo_records_total{{type=\"{}\"}} {}\n", recordTypeNames[iType], total.records[iType]);
+    }
+    addMetric("file_duration_seconds", "histogram", "Time to process each input file.");
+    uint64_t count = 0;
+    for (size_t iBucket = 0; iBucket < std::size(latencyBuckets); ++iBucket) {
+        count += total.latencyCounts[iBucket];
+        text += std::format("hexfileinfo_file_duration_seconds_bucket{{le=\"{}\"}} {}\n", latencyBuckets[iBucket], count);
+    }
+    count += total.latencyCounts[std::size(latencyBuckets)];
+    text += std::format("hexfileinfo_file_duration_seconds_bucket{{le=\"+Inf\"}} {}\n", count);
+    text += std::format("hexfileinfo_file_duration_seconds_sum {}\n", total.latencySum);
+    text += std::format("hexfileinfo_file_duration_seconds_count {}\n", count);
+    addMetric("run_duration_seconds", "gauge", "Time for the whole run.");
+    text += std::format("hexfileinfo_run_duration_seconds {}\n", runSeconds);
+    addMetric("throughput_bytes_per_second", "gauge", "Input bytes per second over the whole run.");
+    text += std::format("hexfileinfo_throughput_bytes_per_second {}\n", runSeconds > 0 ? double(total.inputBytes) / runSeconds : 0.0);
+    addMetric("peak_memory_bytes", "gauge", "Peak resident set size of the process.");
+    text += std::format("hexfileinfo_peak_memory_bytes {}\n", getPeakMemoryUsage());
+    addMetric("last_run_timestamp_seconds", "gauge", "Time the run finished, in seconds since the Unix epoch.");
+    text += std::format("hexfileinfo_last_run_timestamp_seconds {}\n",
+        std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+
+    std::string tempFileName = fileName + ".tmp";
+    std::ofstream outFile(tempFileName, std::ios::out | std::ios::binary);
+    if (outFile.fail()) {
+        throwFileError("Failed to create file", tempFileName);
+    }
+    outFile << text;
+    outFile.close();
+    if (outFile.fail()) {
+        throwFileError("Error writing file", tempFileName);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempFileName, fileName, ec);
+    if (ec) {
+        throwFileError("Failed to rename file to", fileName);
+    }
+}
+
+// File timings
+// With --slowest, the time for each file is recorded, and at the end the
+// percentiles and the slowest files are shown, to find pathological inputs.
+
+struct FileTiming
+{
+    std::string fileName;
+    double seconds;
+    uint64_t inputSize;
+    size_t numSegments;
+};
+
+static PerThread<std::vector<FileTiming>> fileTimings;
+
+// printFileTimings - Show the latency percentiles and the slowest files
+// This must only be called when no other threads are running.
+static void printFileTimings(unsigned numSlowest, std::ostream& out)
+{
+    std::vector<FileTiming> timings;
+    for (const std::vector<FileTiming>& shard : fileTimings.all()) {
+        timings.insert(timings.end(), shard.begin(), shard.end());
+    }
+    if (timings.empty()) {
+        return;
+    }
+    std::ranges::sort(timings, std::ranges::greater{}, &FileTiming::seconds);
+    // Nearest-rank percentile, counting from the slowest
+    auto percentile = [&timings](unsigned pct) {
+        size_t rank = (timings.size() * pct + 99) / 100;
+        return timings[timings.size() - std::max<size_t>(rank, 1)].seconds;
+    };
+    out << std::format("{} files, latency p50 {:.3f} ms, p90 {:.3f} ms, p99 {:.3f} ms, max {:.3f} ms\n",
+        timings.size(), percentile(50) * 1000, percentile(90) * 1000, percentile(99) * 1000,
+        timings.front().seconds * 1000);
+    size_t numShown = std::min<size_t>(numSlowest, timings.size());
+    out << std::format("{} slowest files:\n", numShown);
+    for (const FileTiming& timing : std::span(timings).first(numShown)) {
+        double rate = timing.seconds > 0 ? double(timing.inputSize) / timing.seconds / 1e6 : 0;
+        out << std::format("{:.3f} ms, {:.1f} MB/s, {} data segments: {}\n",
+            timing.seconds * 1000, rate, timing.numSegments, timing.fileName);
+    }
+}
+
+// Image cache
+// In batch mode the same file may be listed many times, e.g. in the image lists
+// of several stations. With --cache-size, parsed images are kept in an LRU cache
+// keyed by the file's identity, up to a memory budget, and are only parsed again
+// if they change. If a file is requested while it's being parsed, the request
+// waits for that parse rather than starting another.
+
+struct FileIdentity
+{
+    std::string path; // canonical
+    uint64_t size;
+    std::filesystem::file_time_type modifiedTime;
+
+    bool operator==(const FileIdentity&) const = default;
+};
+
+struct FileIdentityHash
+{
+    size_t operator()(const FileIdentity& id) const
+    {
+        size_t hash = std::hash<std::string>()(id.path);
+        hash = hash * 31 + std::hash<uint64_t>()(id.size);
+        return hash * 31 + std::hash<int64_t>()(int64_t(id.modifiedTime.time_since_epoch().count()));
+    }
+};
+
+// getFileIdentity - Get the identity of a file, or false if it can't be found
+static bool getFileIdentity(const char* fileArg, FileIdentity& id)
+{
+    std::error_code ec;
+    id.path = std::filesystem::canonical(fileArg, ec).string();
+    if (!ec) {
+        id.size = std::filesystem::file_size(id.path, ec);
+    }
+    if (!ec) {
+        id.modifiedTime = std::filesystem::last_write_time(id.path, ec);
+    }
+    return !ec;
+}
+
+// CachedImage - A parsed image, with any output from the parser, and the hex
+// text if the output is made from it
+struct CachedImage
+{
+    ImageInfo info;
+    std::string parseOutput;
+    ReadBuffer text;
+};
+
+// getMemorySize - Get the approximate memory used by a cached image
+static uint64_t getMemorySize(const CachedImage& image)
+{
+    uint64_t size = sizeof(CachedImage) + image.parseOutput.capacity() + image.text.capacity();
+    for (const Chunk& chunk : image.info.chunks) {
+        size += sizeof(Chunk) + 2 * sizeof(void*) + chunk.data.capacity();
+    }
+    return size;
+}
+
+// ImageCache - LRU cache of parsed images with a memory budget
+class ImageCache
+{
+public:
+    using ImagePtr = std::shared_ptr<const CachedImage>;
+
+    explicit ImageCache(uint64_t budget) : budget(budget) {}
+
+    // get - Get an image from the cache, or call parse() to make it
+    // Exceptions from parse() are passed on to all callers waiting for it, and
+    // the failure isn't cached.
+    ImagePtr get(const FileIdentity& id, const auto& parse)
+    {
+        std::unique_lock lock(mutex);
+        if (auto found = index.find(id); found != index.end()) {
+            lru.splice(lru.begin(), lru, found->second);
+            std::shared_future<ImagePtr> image = found->second->image;
+            lock.unlock();
+            return image.get();
+        }
+        std::promise<ImagePtr> promise;
+        lru.push_front({ id, promise.get_future().share() });
+        index.emplace(id, lru.begin());
+        lock.unlock();
+        ImagePtr image;
+        try {
+            image = std::make_shared<const CachedImage>(parse());
+        } catch (...) {
+            lock.lock();
+            erase(id);
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        lock.lock();
+        if (auto found = index.find(id); found != index.end()) {
+            found->second->size = getMemorySize(*image);
+            used += found->second->size;
+            evict();
+        }
+        lock.unlock();
+        promise.set_value(image);
+        return image;
+    }
+
+private:
+    struct Entry
+    {
+        FileIdentity id;
+        std::shared_future<ImagePtr> image;
+        uint64_t size = 0; // 0 while it's being parsed
+    };
+
+    void erase(const FileIdentity& id)
+    {
+        if (auto found = index.find(id); found != index.end()) {
+            used -= found->second->size;
+            lru.erase(found->second);
+            index.erase(found);
+        }
+    }
+
+    // evict - Remove the least recently used images until the cache is within budget
+    // Images that are being parsed aren't counted yet, so they're left alone.
+    void evict()
+    {
+        for (auto iter = lru.end(); used > budget && iter != lru.begin();) {
+            --iter;
+            if (iter->size > 0) {
+                used -= iter->size;
+                index.erase(iter->id);
+                iter = lru.erase(iter);
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<FileIdentity, std::list<Entry>::iterator, FileIdentityHash> index;
+    uint64_t budget;
+    uint64_t used = 0;
+};
+
+static std::unique_ptr<ImageCache> imageCache;
+
+// Progress report
+// With --progress, a timer thread shows the bytes processed, the rate, and the
+// estimated time remaining on stderr, plus each worker's progress in batch mode.
+// On a terminal the line is redrawn in place; otherwise a line is written every
+// few seconds, for log files.
+
+static std::atomic<uint64_t> progressBytesTotal = 0;
+static std::atomic<unsigned> progressFilesDone = 0;
+static std::atomic<unsigned> progressFilesTotal = 0; // grows as archives are read
+static std::unique_ptr<WorkerProgress[]> workerProgress;
+static unsigned numWorkerProgress = 0;
+
+// fileSizeOrZero - Get the size of a file, or 0 if it can't be found (e.g. stdin)
+static uint64_t fileSizeOrZero(const char* fileArg)
+{
+    std::error_code ec;
+    uint64_t size = fileArg ? std::filesystem::file_size(fileArg, ec) : 0;
+    return ec ? 0 : size;
+}
+
+// formatByteCount - Format a number of bytes for a person to read
+static std::string formatByteCount(double bytes)
+{
+    const char* const units[] = { "B", "kB", "MB", "GB", "TB" };
+    unsigned iUnit = 0;
+    while (bytes >= 1000 && iUnit + 1 < std::size(units)) {
+        bytes /= 1000;
+        ++iUnit;
+    }
+    return iUnit == 0 ? std::format("{:.0f} B", bytes) : std::format("{:.1f} {}", bytes, units[iUnit]);
+}
+
+static bool isTerminal(FILE* file)
+{
+#ifdef _WIN32
+    return _isatty(_fileno(file));
+#else
+    return isatty(fileno(file));
+#endif
+}
+
+// formatProgress - Make the progress line for the run so far
+static std::string formatProgress(double seconds)
+{
+    uint64_t done = progressBytesDone.load(std::memory_order_relaxed);
+    uint64_t total = progressBytesTotal.load(std::memory_order_relaxed);
+    double rate = seconds > 0 ? done / seconds : 0;
+    std::string line = formatByteCount(double(done));
+    if (total > 0) {
+        line += std::format(" / {} ({}%)", formatByteCount(double(total)), std::min<uint64_t>(done * 100 / total, 100));
+    }
+    line += std::format(", {}/s", formatByteCount(rate));
+    if (total > done && rate > 0) {
+        auto remaining = unsigned((total - done) / rate);
+        line += std::format(", ETA {}:{:02}:{:02}", remaining / 3600, remaining / 60 % 60, remaining % 60);
+    }
+    unsigned numFiles = progressFilesTotal.load(std::memory_order_relaxed);
+    if (numFiles > 1) {
+        line += std::format(", {}/{} files", progressFilesDone.load(), numFiles);
+        for (unsigned iWorker = 0; iWorker < numWorkerProgress; ++iWorker) {
+            const WorkerProgress& progress = workerProgress[iWorker];
+            uint64_t fileSize = progress.fileSize.load(std::memory_order_relaxed);
+            if (progress.fileName.load(std::memory_order_relaxed) && fileSize > 0) {
+                line += std::format(" [{}:{}%]", iWorker + 1,
+                    std::min<uint64_t>(progress.bytesDone.load(std::memory_order_relaxed) * 100 / fileSize, 100));
+            }
+        }
+    }
+    return line;
+}
+
+// ProgressReporter - Shows the progress on stderr while it exists
+class ProgressReporter
+{
+public:
+    ProgressReporter(unsigned numFiles, unsigned numWorkers, uint64_t totalBytes)
+    {
+        progressFilesTotal = numFiles;
+        workerProgress = std::make_unique<WorkerProgress[]>(numWorkers);
+        numWorkerProgress = numWorkers;
+        progressBytesTotal = totalBytes;
+        thread = std::jthread([this](std::stop_token stopToken) { run(stopToken); });
+    }
+
+    ~ProgressReporter()
+    {
+        thread.request_stop();
+        thread.join();
+        std::cerr << std::format("{}{}\n", toTerminal ? "\r" : "", formatProgress(elapsedSeconds()));
+    }
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+private:
+    void run(std::stop_token stopToken)
+    {
+        const auto interval = toTerminal ? std::chrono::milliseconds(500) : std::chrono::seconds(10);
+        std::mutex mutex;
+        std::condition_variable_any wakeUp;
+        std::unique_lock lock(mutex);
+        size_t lastLength = 0;
+        for (;;) {
+            wakeUp.wait_for(lock, stopToken, interval, [] { return false; });
+            if (stopToken.stop_requested()) {
+                break;
+            }
+            std::string line = formatProgress(elapsedSeconds());
+            if (toTerminal) {
+                // Pad with spaces to erase the end of a longer previous line.
+                size_t length = line.size();
+                line.resize(std::max(length, lastLength), ' ');
+                lastLength = length;
+                std::cerr << '\r' << line << std::flush;
+            } else {
+                std::cerr << line << '\n';
+            }
+        }
+    }
+
+    double elapsedSeconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    bool toTerminal = isTerminal(stderr);
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    std::jthread thread;
+};
+
+static void printUsage()
+{
+    std::cerr << std::format("Usage: {} [options] [input-file...]\n", progName);
+    std::cerr << "Options:\n"
+        "  --uf2 FILE     Write the data to a UF2 file\n"
+        "  --family ID    Family ID for the UF2 file (default 0xE48BFF56, RP2040)\n"
+        "  --memfd SOCKET  Send the decoded image in a sealed memfd over a Unix socket\n"
+        "  --multi        Input contains several hex images, each ending with an EOF record\n"
+        "  --rebase OFFSET  Move the data by OFFSET (may be negative) and write it to the output file\n"
+        "  --output FILE  Write the data to a hex file\n"
+        "  --insert-crc ADDR  Store the length and CRC-32 of the --range at ADDR\n"
+        "  --range START:END  Address range for --insert-crc (END is the address after it)\n"
+        "  --fill BYTE    Value of the gaps in the --range (default 0xFF)\n"
+        "  --verify FILE  Compare the data with a golden image, failing if it differs\n"
+        "  --ignore START:END  Address range that --verify ignores (may be repeated)\n"
+        "  --map FILE     Show which sections and symbols in a linker map file the data belongs to\n"
+        "  --entropy      Show the entropy of the data in each page\n"
+        "  --entropy-page SIZE  Page size for --entropy (default 0x1000)\n"
+        "  --entropy-range MIN:MAX  Report pages with entropy outside this range, in bits per byte\n"
+        "  --jobs N       Number of files to process at once (default: number of CPU cores)\n"
+        "  --trace FILE   Write a timeline of the run in Chrome trace event format\n"
+        "  --metrics-file FILE  Write totals for the run in Prometheus text format\n"
+        "  --slowest N    Show latency percentiles and the N slowest files at the end\n"
+        "  --stats        Show the memory used for each file and the peak memory use of the run\n"
+        "  --progress     Show the bytes processed, rate, and time remaining on stderr\n"
+        "  --io MODE      How to read input files: buffered (default), direct, dontneed, or hot\n"
+        "  --cache-size MB  Parse each file only once in a batch, caching up to MB megabytes of images\n"
+        "  --background   Run at low CPU and I/O priority, with fewer workers when the system is busy\n"
+        "  --max-read-rate MB  Limit reading input files to MB megabytes per second\n"
+        "  --read-buffer SIZE  Size of the buffer for reading input files\n"
+        "  --calibrate    Find the fastest --io, --read-buffer and --jobs settings for this host and save them\n"
+        "Input files named *.uf2 are read as UF2 files.\n"
+        "Input files named *.tar, *.tar.gz or *.tar.zst are archives of hex and UF2 files.\n";
 }
 
-static void throwFileError(const char* message)
+// Background mode
+// --background lets big batches run on a host that's doing other work, e.g.
+// serving builds: the program runs at the lowest CPU and I/O priority, and the
+// number of workers backs off when the system is busy. --max-read-rate limits
+// how fast the input files (and archives) are read.
+
+// lowerPriority - Run at the lowest CPU and I/O priority
+// On Linux these are per thread, so this must be called before starting threads,
+// which inherit them.
+static void lowerPriority()
+{
+#ifdef _WIN32
+    // Background mode lowers the I/O and memory priority as well.
+    SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#else
+    setpriority(PRIO_PROCESS, 0, 19);
+#ifdef __linux__
+    // ioprio_set has no wrapper in glibc. The idle class only gets the disk when
+    // nothing else wants it (with the BFQ scheduler; others ignore I/O priorities).
+    const int ioprioWhoProcess = 1;
+    const int ioprioClassIdle = 3;
+    const int ioprioClassShift = 13;
+    syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift);
+#endif
+#endif
+}
+
+// RateLimiter - Limits the rate of reads from all threads together
+// It works like a token bucket holding burstTime's worth of bytes: each read is
+// taken from the bucket, and waits until the bucket has refilled enough to cover it.
+class RateLimiter
+{
+public:
+    explicit RateLimiter(double bytesPerSecond) : bytesPerSecond(bytesPerSecond) {}
+
+    // acquire - Count a read of the given size, waiting if it's over the rate
+    void acquire(size_t bytes)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto cost = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(double(bytes) / bytesPerSecond));
+        std::chrono::steady_clock::time_point readyTime;
+        {
+            std::lock_guard lock(mutex);
+            // A full bucket is as far as the schedule can fall behind.
+            paidUntil = std::max(paidUntil, now - burstTime) + cost;
+            readyTime = paidUntil;
+        }
+        std::this_thread::sleep_until(readyTime);
+    }
+
+private:
+    static constexpr std::chrono::milliseconds burstTime{ 100 };
+    double bytesPerSecond;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point paidUntil; // when the reads so far are paid for at the rate
+};
+
+static std::unique_ptr<RateLimiter> readRateLimiter;
+
+// ThrottledStreamBuf - Input stream buffer that reads from another one, at the
+// rate allowed by readRateLimiter
+class ThrottledStreamBuf : public std::streambuf
+{
+public:
+    explicit ThrottledStreamBuf(std::streambuf* source) : source(source) {}
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        std::streamsize size = source->sgetn(buffer.data(), std::streamsize(buffer.size()));
+        if (size > 0) {
+            readRateLimiter->acquire(size_t(size));
+        }
+        setg(buffer.data(), buffer.data(), buffer.data() + std::max<std::streamsize>(size, 0));
+        return size > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+    }
+
+private:
+    static constexpr size_t bufferSize = 0x10000;
+    std::streambuf* source;
+    ReadBuffer buffer = ReadBuffer(bufferSize, '\0');
+};
+
+#ifndef _WIN32
+// WorkerGovernor - Decides how many workers may take jobs, from the system load
+// The load average counts this program's own workers too, so the load from other
+// processes is what's left without them. The number of workers backs off as soon
+// as that goes up, and grows again by one worker at a time, because the load
+// average takes a minute to catch up.
+class WorkerGovernor
+{
+public:
+    explicit WorkerGovernor(unsigned maxWorkers) : maxWorkers(maxWorkers), numAllowed(maxWorkers) {}
+
+    // mayWork - Check whether worker iWorker (from 0) may take another job
+    // Worker 0 always may, so the batch goes on however busy the system is.
+    bool mayWork(unsigned iWorker)
+    {
+        std::lock_guard lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        double load;
+        if (now - lastCheck >= checkInterval && getloadavg(&load, 1) == 1) {
+            lastCheck = now;
+            double otherLoad = std::max(0.0, load - numAllowed);
+            unsigned numIdleCores = unsigned(std::max(0.0, numCores - otherLoad));
+            unsigned target = std::clamp(numIdleCores, 1u, maxWorkers);
+            numAllowed = std::min(target, numAllowed + 1);
+            PROBE2(workers, numAllowed, unsigned(load * 100));
+        }
+        return iWorker < numAllowed;
+    }
+
+    static constexpr std::chrono::seconds checkInterval{ 2 };
+
+private:
+    unsigned maxWorkers;
+    unsigned numAllowed;
+    double numCores = std::max(1u, std::thread::hardware_concurrency());
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point lastCheck;
+};
+
+static std::unique_ptr<WorkerGovernor> workerGovernor;
+#endif
+
+// InputFile - An input file, opened for reading with the selected I/O mode
+class InputFile
+{
+public:
+    static constexpr size_t defaultBufferSize = 0x10000;
+
+    InputFile(const std::string& fileName, bool binary)
+    {
+        open(fileName, binary);
+        if (readRateLimiter) {
+            throttledStreamBuf.emplace(input.rdbuf());
+            input.rdbuf(&*throttledStreamBuf);
+        }
+    }
+
+    std::istream& stream()
+    {
+        return input;
+    }
+
+private:
+    void open(const std::string& fileName, [[maybe_unused]] bool binary)
+    {
+#ifdef __linux__
+        if (ioMode != ioBuffered) {
+            streamBuf.emplace(fileName, ioMode);
+            input.rdbuf(&*streamBuf);
+            return;
+        }
+#endif
+#ifndef _WIN32
+        openFile(fileName);
+#else
+        buffer.resize(readBufferSize > 0 ? readBufferSize : defaultBufferSize);
+        file.rdbuf()->pubsetbuf(buffer.data(), std::streamsize(buffer.size()));
+        file.open(fileName, binary ? std::ios::in | std::ios::binary : std::ios::in);
+        if (file.fail()) {
+            throwFileError("Failed to open file", fileName);
+        }
+        input.rdbuf(file.rdbuf());
+#endif
+    }
+
+#ifndef _WIN32
+    // openFile - Open the file once and read it through its file descriptor.
+    // A small file is read with a single read, which is much quicker to set up
+    // than a file stream, but --max-read-rate couldn't spread that out.
+    void openFile(const std::string& fileName)
+    {
+        int fd = fileDescriptor.emplace(fileName.c_str()).get();
+        struct stat st;
+        if (!readRateLimiter && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && uint64_t(st.st_size) <= smallFileSize) {
+            buffer.resize(size_t(st.st_size));
+            size_t size = 0;
+            while (size < buffer.size()) {
+                ssize_t n = ::read(fd, buffer.data() + size, buffer.size() - size);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    throwFileError("Error reading file", fileName);
+                }
+                if (n == 0) {
+                    break;
+                }
+                size += size_t(n);
+            }
+            buffer.resize(size);
+            fileDescriptor.reset();
+            memoryStreamBuf.emplace(buffer.data(), buffer.size());
+            input.rdbuf(&*memoryStreamBuf);
+            return;
+        }
+        buffer.resize(readBufferSize > 0 ? readBufferSize : defaultBufferSize);
+        fdStreamBuf.emplace(fd, std::span(buffer.data(), buffer.size()));
+        input.rdbuf(&*fdStreamBuf);
+    }
+#endif
+
+    static constexpr size_t smallFileSize = 0x20000;
+    ReadBuffer buffer; // the file stream's buffer, or the whole of a small file
+#ifdef _WIN32
+    std::ifstream file;
+#else
+    std::optional<FileDescriptor> fileDescriptor;
+    std::optional<FdStreamBuf> fdStreamBuf;
+#endif
+    std::optional<MemoryStreamBuf> memoryStreamBuf;
+#ifdef __linux__
+    std::optional<FileStreamBuf> streamBuf;
+#endif
+    std::optional<ThrottledStreamBuf> throttledStreamBuf;
+    std::istream input{ nullptr };
+};
+
+// Archive input
+// In batch mode, a .tar, .tar.gz (.tgz) or .tar.zst (.tzst) input file is read
+// as one sequential stream, and the hex and UF2 files in it are handed to the
+// workers in memory instead of being extracted. They're reported as
+// ARCHIVE:PATH. Other files in the archive are skipped.
+
+enum archiveType_t {
+    archiveNone,
+    archiveTar,
+    archiveGzip, // tar.gz
+    archiveZstd // tar.zst
+};
+
+// getArchiveType - Get the type of archive from a file name
+static archiveType_t getArchiveType(std::string fileName)
 {
-    throwError(std::format("{} {}", message, inFileName).c_str());
+    std::ranges::transform(fileName, fileName.begin(), [](unsigned char ch) { return char(std::tolower(ch)); });
+    if (fileName.ends_with(".tar")) {
+        return archiveTar;
+    } else if (fileName.ends_with(".tar.gz") || fileName.ends_with(".tgz")) {
+        return archiveGzip;
+    } else if (fileName.ends_with(".tar.zst") || fileName.ends_with(".tzst")) {
+        return archiveZstd;
+    }
+    return archiveNone;
 }
 
-static void throwFormatError()
+// isImageFileName - Check whether a file in an archive is one to process
+static bool isImageFileName(const std::string& fileName)
 {
-    throwError("Invalid data in hex file");
+    std::string ext = getExtension(fileName);
+    return ext == ".hex" || ext == ".ihex" || ext == ".ihx" || ext == ".uf2";
 }
 
-static std::string makePrintable(const std::string& str)
+#ifdef HEXFILEINFO_HAVE_ZLIB
+// GzipStreamBuf - Input stream buffer that decompresses a gzip stream
+class GzipStreamBuf : public std::streambuf
 {
-    const unsigned maxLen = 64;
-    std::string strNew;
-    if (str.size() <= maxLen) {
-        strNew = str;
-    } else {
-        strNew = str.substr(0, maxLen) + "[etc]";
+public:
+    explicit GzipStreamBuf(std::istream& source) : source(source)
+    {
+        // 15 + 32: any window size, with a gzip or zlib header
+        if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+            throwError("Failed to start decompression");
+        }
+    }
+
+    ~GzipStreamBuf()
+    {
+        inflateEnd(&stream);
     }
-    for (auto& ch : strNew) {
-        if (!std::isprint(static_cast<unsigned char>(ch))) {
-            ch = '?';
+
+    GzipStreamBuf(const GzipStreamBuf&) = delete;
+    GzipStreamBuf& operator=(const GzipStreamBuf&) = delete;
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        while (!finished) {
+            if (stream.avail_in == 0) {
+                source.read(inBuffer.data(), std::streamsize(inBuffer.size()));
+                stream.next_in = reinterpret_cast<Bytef*>(inBuffer.data());
+                stream.avail_in = uInt(source.gcount());
+                if (stream.avail_in == 0) {
+                    throwError(source.bad() ? "Error reading file" : "Unexpected end of compressed data");
+                }
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
+            stream.avail_out = uInt(outBuffer.size());
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_STREAM_END) {
+                // A gzip file may contain several compressed streams one after another.
+                if (stream.avail_in == 0 && source.peek() == traits_type::eof()) {
+                    finished = true;
+                } else {
+                    inflateReset(&stream);
+                }
+            } else if (result != Z_OK && result != Z_BUF_ERROR) {
+                throwError("Invalid compressed data");
+            }
+            size_t size = outBuffer.size() - stream.avail_out;
+            if (size > 0) {
+                setg(outBuffer.data(), outBuffer.data(), outBuffer.data() + size);
+                return traits_type::to_int_type(*gptr());
+            }
         }
+        return traits_type::eof();
     }
-    return strNew;
-}
 
-static unsigned fromHex(const std::span<char>& hex)
+private:
+    static constexpr size_t bufferSize = 0x10000;
+    std::istream& source;
+    z_stream stream = {};
+    bool finished = false;
+    ReadBuffer inBuffer = ReadBuffer(bufferSize, '\0');
+    ReadBuffer outBuffer = ReadBuffer(bufferSize, '\0');
+};
+#endif
+
+#ifdef HEXFILEINFO_HAVE_ZSTD
+// ZstdStreamBuf - Input stream buffer that decompresses a zstd stream
+class ZstdStreamBuf : public std::streambuf
 {
-    unsigned n = 0;
-    if (hex.size() > 2 * sizeof(n)) throwError("Number too large");
-    for (char digit : hex) {
-        if (!std::isxdigit(digit)) throwFormatError();
-        digit = std::tolower(digit);
-        n = n * 16 + (digit >= 'a' ? digit - 'a' + 10 : digit - '0');
+public:
+    explicit ZstdStreamBuf(std::istream& source) : source(source), stream(ZSTD_createDStream())
+    {
+        if (!stream) {
+            throwError("Failed to start decompression");
+        }
     }
-    return n;
-}
 
-// Chunk - Represents a chunk of data from several contiguous data records
-// (no actual data included)
-struct Chunk
+    ~ZstdStreamBuf()
+    {
+        ZSTD_freeDStream(stream);
+    }
+
+    ZstdStreamBuf(const ZstdStreamBuf&) = delete;
+    ZstdStreamBuf& operator=(const ZstdStreamBuf&) = delete;
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        for (;;) {
+            if (input.pos == input.size) {
+                source.read(inBuffer.data(), std::streamsize(inBuffer.size()));
+                input = { inBuffer.data(), size_t(source.gcount()), 0 };
+                if (input.size == 0) {
+                    if (source.bad()) {
+                        throwError("Error reading file");
+                    }
+                    // Decompression returns 0 at the end of a frame.
+                    if (lastResult != 0) {
+                        throwError("Unexpected end of compressed data");
+                    }
+                    return traits_type::eof();
+                }
+            }
+            ZSTD_outBuffer output = { outBuffer.data(), outBuffer.size(), 0 };
+            lastResult = ZSTD_decompressStream(stream, &output, &input);
+            if (ZSTD_isError(lastResult)) {
+                throwError("Invalid compressed data");
+            }
+            if (output.pos > 0) {
+                setg(outBuffer.data(), outBuffer.data(), outBuffer.data() + output.pos);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+    }
+
+private:
+    static constexpr size_t bufferSize = 0x20000; // about ZSTD_DStreamInSize()
+    std::istream& source;
+    ZSTD_DStream* stream;
+    ZSTD_inBuffer input = {};
+    size_t lastResult = 0;
+    ReadBuffer inBuffer = ReadBuffer(bufferSize, '\0');
+    ReadBuffer outBuffer = ReadBuffer(bufferSize, '\0');
+};
+#endif
+
+// ArchiveMember - A file read from an archive
+struct ArchiveMember
 {
-    unsigned address;
-    unsigned size;
+    std::string name; // ARCHIVE:PATH
+    std::vector<char> data;
 };
 
-// checkMergeChunk - Merge the given chunk into the chunk pointed to by iter, if possible
-static bool checkMergeChunk(Chunk chunk, auto iter)
+// TarReader - Reads the files in a tar archive in order
+// POSIX ustar and pax headers and GNU long names are understood.
+class TarReader
 {
-    if (iter->address + iter->size == chunk.address) {
-        iter->size += chunk.size;
-        return true;
-    } else if (chunk.address + chunk.size == iter->address) {
-        iter->address = chunk.address;
-        iter->size += chunk.size;
+public:
+    explicit TarReader(std::istream& input) : input(input) {}
+
+    // next - Read the next regular file for which isWanted(path) is true,
+    // skipping the others, or return false at the end of the archive
+    bool next(std::string& path, std::vector<char>& data, const auto& isWanted)
+    {
+        std::string longPath;
+        uint64_t paxSize = noSize;
+        for (;;) {
+            char header[blockSize];
+            if (!readBlock(header) || std::all_of(header, header + blockSize, [](char ch) { return ch == 0; })) {
+                return false;
+            }
+            checkHeader(header);
+            uint64_t size = (paxSize != noSize) ? paxSize : parseNumber(std::span(header + 124, 12));
+            char type = header[156];
+            if (type == 'L') {
+                // GNU long name for the next entry
+                longPath = readString(size);
+            } else if (type == 'x') {
+                // pax extended header for the next entry
+                parsePaxHeader(readString(size), longPath, paxSize);
+            } else {
+                bool isFile = (type == '0' || type == '\0' || type == '7');
+                path = longPath.empty() ? getHeaderPath(header) : longPath;
+                longPath.clear();
+                paxSize = noSize;
+                if (isFile && isWanted(path)) {
+                    data.resize(size_t(size));
+                    readExact(data.data(), size);
+                    skip(padding(size));
+                    return true;
+                }
+                // Directories, links, global pax headers, other files, etc.
+                skip(size + padding(size));
+            }
+        }
+    }
+
+private:
+    static constexpr size_t blockSize = 512;
+    static constexpr uint64_t noSize = UINT64_MAX;
+
+    static uint64_t padding(uint64_t size)
+    {
+        return (blockSize - size % blockSize) % blockSize;
+    }
+
+    // parseNumber - Parse a numeric header field, octal or GNU base-256
+    static uint64_t parseNumber(std::span<const char> field)
+    {
+        uint64_t n = 0;
+        if (static_cast<unsigned char>(field[0]) & 0x80) {
+            for (char ch : field.subspan(1)) {
+                n = (n << 8) | static_cast<unsigned char>(ch);
+            }
+            return n;
+        }
+        auto iter = std::ranges::find_if(field, [](char ch) { return ch != ' '; });
+        for (; iter != field.end() && *iter >= '0' && *iter <= '7'; ++iter) {
+            n = n * 8 + unsigned(*iter - '0');
+        }
+        return n;
+    }
+
+    static std::string getField(std::span<const char> field)
+    {
+        return std::string(field.begin(), std::ranges::find(field, '\0'));
+    }
+
+    static std::string getHeaderPath(const char* header)
+    {
+        std::string name = getField(std::span(header, 100));
+        if (std::string_view(header + 257, 5) == "ustar" && header[345] != '\0') {
+            return getField(std::span(header + 345, 155)) + '/' + name;
+        }
+        return name;
+    }
+
+    static void checkHeader(const char* header)
+    {
+        // The checksum is the sum of the header bytes, with the checksum field as spaces.
+        uint64_t sum = 0;
+        for (size_t i = 0; i < blockSize; ++i) {
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (sum != parseNumber(std::span(header + 148, 8))) {
+            throwError("Invalid tar header");
+        }
+    }
+
+    // parsePaxHeader - Get the path and size from pax records ("LENGTH KEY=VALUE\n")
+    static void parsePaxHeader(std::string_view records, std::string& path, uint64_t& size)
+    {
+        while (!records.empty()) {
+            size_t length = 0;
+            auto [ptr, ec] = std::from_chars(records.data(), records.data() + records.size(), length);
+            if (ec != std::errc() || *ptr != ' ' || length > records.size() || length <= size_t(ptr - records.data())) {
+                throwError("Invalid tar header");
+            }
+            std::string_view record = records.substr(0, length);
+            records.remove_prefix(length);
+            record.remove_prefix(size_t(ptr - record.data()) + 1);
+            if (record.ends_with('\n')) {
+                record.remove_suffix(1);
+            }
+            size_t equals = record.find('=');
+            if (equals == record.npos) {
+                continue;
+            }
+            std::string_view key = record.substr(0, equals);
+            std::string_view value = record.substr(equals + 1);
+            if (key == "path") {
+                path = value;
+            } else if (key == "size") {
+                if (std::from_chars(value.data(), value.data() + value.size(), size).ec != std::errc()) {
+                    throwError("Invalid tar header");
+                }
+            }
+        }
+    }
+
+    // readBlock - Read a header block, or return false at the end of the input
+    // (some tar writers leave out the blocks of zeros at the end)
+    bool readBlock(char* block)
+    {
+        input.read(block, blockSize);
+        if (input.gcount() == 0 && input.eof()) {
+            return false;
+        }
+        if (size_t(input.gcount()) != blockSize) {
+            throwError(input.bad() ? "Error reading file" : "Unexpected end of tar file");
+        }
         return true;
     }
-    return false;
-}
 
-enum recordType_t {
-    typeNone = -1,
-    typeData = 0,
-    typeEof = 1,
-    typeEsa = 2,
-    typeSsa = 3,
-    typeEla = 4,
-    typeSla = 5
+    std::string readString(uint64_t size)
+    {
+        std::string str(size_t(size), '\0');
+        readExact(str.data(), size);
+        skip(padding(size));
+        str.erase(std::ranges::find(str, '\0'), str.end());
+        return str;
+    }
+
+    void readExact(char* data, uint64_t size)
+    {
+        input.read(data, std::streamsize(size));
+        if (uint64_t(input.gcount()) != size) {
+            throwError(input.bad() ? "Error reading file" : "Unexpected end of tar file");
+        }
+    }
+
+    // skip - Skip data, by reading it since the input may not be seekable
+    void skip(uint64_t size)
+    {
+        char buffer[0x2000];
+        while (size > 0) {
+            uint64_t n = std::min<uint64_t>(size, sizeof(buffer));
+            readExact(buffer, n);
+            size -= n;
+        }
+    }
+
+    std::istream& input;
 };
 
-static void processHexFile(std::istream& input)
+// readArchive - Read the hex and UF2 files in an archive in order,
+// calling addMember(member) for each one
+static void readArchive(const std::string& fileName, const auto& addMember)
 {
-    const unsigned dataOffset = 1 + 2 + 4 + 2; // ':' + count + address + type
-    const unsigned minLineSize = dataOffset + 0 + 2; // ... + no data + checksum
-    const unsigned maxLineSize = minLineSize + 2 * 255; // max data = 255 bytes
-    std::list<Chunk> chunks;
-    unsigned numOverlapping = 0;
-    unsigned baseAddress = 0;
-    bool foundEof = false;
-    unsigned numStartAddresses = 0;
-    unsigned startAddress = 0;
-    unsigned numDataRecords = 0;
-    unsigned maxDataSize = 0;
-    std::cout << std::format("HEX file: {}\n", inFileName);
-    std::string stLine;
-    unsigned iLine = 1;
-    try {
-        while (std::getline(input, stLine)) {
-            // If the previous line was an EOF record then EOF wasn't EOF.
-            if (foundEof) {
-                throwError("EOF record before end of file");
-            }
-            // Parse the line
-            std::span line(stLine);
-            if (line.size() < minLineSize) throwFormatError();
-            if (line.size() > maxLineSize) throwFormatError();
-            if (line.front() != ':') throwFormatError();
-            unsigned dataSize = fromHex(line.subspan(1, 2));
-            if (line.size() != minLineSize + 2 * dataSize) throwFormatError();
-            unsigned address = baseAddress + fromHex(line.subspan(3, 4));
-            recordType_t recordType = recordType_t(fromHex(line.subspan(7, 2)));
-            std::span dataSpan = line.subspan(dataOffset, 2 * dataSize);
-            // Check the checksum
-            unsigned char checksum = 0;
-            for (unsigned i = 1; i < line.size() - 1; i += 2) {
-                checksum += fromHex(line.subspan(i, 2));
-            }
-            if (checksum != 0) throwError("Incorrect checksum");
-            // Handle the various record types.
-            switch (recordType) {
-            default:
-                // Bad record type
-                throwFormatError();
-            case typeEof:
-                // End-of-file record
-                if (dataSize != 0) throwFormatError();
-                foundEof = true;
-                break;
-            case typeEsa:
-                // Base address segment
-                if (dataSize != 2) throwFormatError();
-                baseAddress = fromHex(dataSpan) << 4;
-                break;
-            case typeSsa:
-                // Start address CS:IP
-                if (dataSize != 4) throwFormatError();
-                startAddress = (fromHex(line.subspan(dataOffset, 4)) << 4)
-                    + fromHex(line.subspan(dataOffset + 4, 4));
-                ++numStartAddresses;
-                break;
-            case typeEla:
-                // Base address linear
-                if (dataSize != 2) throwFormatError();
-                baseAddress = fromHex(dataSpan) << 16;
-                break;
-            case typeSla:
-                // Start address linear
-                if (dataSize != 4) throwFormatError();
-                startAddress = fromHex(dataSpan);
-                ++numStartAddresses;
+    archiveType_t type = getArchiveType(fileName);
+    InputFile inFile(fileName, true);
+    std::istream* input = &inFile.stream();
+    std::istream decompressed(nullptr);
+#ifdef HEXFILEINFO_HAVE_ZLIB
+    std::optional<GzipStreamBuf> gzipStreamBuf;
+#endif
+#ifdef HEXFILEINFO_HAVE_ZSTD
+    std::optional<ZstdStreamBuf> zstdStreamBuf;
+#endif
+    if (type == archiveGzip) {
+#ifdef HEXFILEINFO_HAVE_ZLIB
+        decompressed.rdbuf(&gzipStreamBuf.emplace(*input));
+        input = &decompressed;
+#else
+        throwError("gzip archives are not supported in this build");
+#endif
+    } else if (type == archiveZstd) {
+#ifdef HEXFILEINFO_HAVE_ZSTD
+        decompressed.rdbuf(&zstdStreamBuf.emplace(*input));
+        input = &decompressed;
+#else
+        throwError("zstd archives are not supported in this build");
+#endif
+    }
+    if (input == &decompressed) {
+        // Errors from the decompressor must get out, not just set badbit.
+        decompressed.exceptions(std::ios::badbit);
+    }
+    TarReader reader(*input);
+    for (;;) {
+        auto member = std::make_unique<ArchiveMember>();
+        std::string path;
+        try {
+            if (!reader.next(path, member->data, isImageFileName)) {
                 break;
-            case typeData:
-                // Data record
-                // Add this data chunk to the list, in order of address.
-                // Add chunks in reverse order because that's usually quicker.
-                // Merge adjacent chunks into one.
-                Chunk chunk{ address, dataSize };
-                bool fAdded = false;
-                // Find this data chunk's place in the list.
-                for (auto iter = chunks.begin(); iter != chunks.end(); ++iter) {
-                    // Check for overlap
-                    if (iter->address + iter->size > chunk.address
-                        && chunk.address + chunk.size > iter->address)
-                    {
-                        ++numOverlapping;
-                    }
-                    // Check whether to merge or add this chunk here.
-                    if (checkMergeChunk(chunk, iter)) {
-                        fAdded = true;
-                    } else if (chunk.address >= iter->address) {
-                        iter = chunks.insert(iter, chunk);
-                        fAdded = true;
+            }
+        } catch (const std::exception& e) {
+            throwError(std::format("{}: {}", fileName, e.what()).c_str());
+        }
+        member->name = fileName + ':' + path;
+        addMember(std::move(member));
+    }
+}
+
+// processMultiHexFile - Read a file containing several concatenated hex images
+// Each image is parsed on its own thread. The images are summarized individually
+// and the combined image is returned.
+static ImageInfo processMultiHexFile(std::istream& input, bool keepData, std::ostream& out)
+{
+    TraceSpan readSpan("read", inFileName);
+    ReadBuffer text = readAll(input);
+    readSpan.end();
+    TraceSpan parseSpan("parse images", inFileName);
+    std::exception_ptr error;
+    std::vector<ImageInfo> infos = parseHexImages(text, error, keepData);
+    parseSpan.end();
+    // Report the images in order up to the first error.
+    for (size_t iImage = 0; iImage < infos.size(); ++iImage) {
+        const ImageInfo& info = infos[iImage];
+        out << std::format("Image {}, lines {}-{}:\n", iImage + 1, info.firstLine, info.lastLine);
+        printImageInfo(info, out);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    TraceSpan mergeSpan("merge", inFileName);
+    ImageInfo total = combineImages(infos, keepData);
+    out << std::format("All {} images:\n", infos.size());
+    return total;
+}
+
+// needImageData - Check whether the options need the image data, rather than
+// just the layout of the image for the summary
+static bool needImageData()
+{
+    return !outFileName.empty() || !uf2FileName.empty() || !memfdSocketName.empty() || rebase || insertCrc
+        || showEntropy || !verifyFileName.empty();
+}
+
+// parseInput - Parse the input in the format given by the options
+// Text of the input is left in textInput if it's needed for the output.
+static void parseInput(std::istream& input, bool inUf2, ImageInfo& info, std::ostream& out, ReadStream& textInput)
+{
+    bool keepData = needImageData();
+    if (inUf2) {
+        TraceSpan span("parse", inFileName);
+        processUf2File(input, info, keepData);
+    } else if (multiImage) {
+        info = processMultiHexFile(input, keepData, out);
+    } else if (rebase || insertCrc) {
+        TraceSpan readSpan("read", inFileName);
+        textInput.str(readAll(input));
+        readSpan.end();
+        TraceSpan span("parse", inFileName);
+        processHexFile(textInput, info, keepData);
+    } else {
+        TraceSpan span("parse", inFileName);
+        processHexFile(input, info, keepData);
+    }
+}
+
+static ImageInfo goldenImage;
+static MapFile linkerMap; // from --map, loaded once for all the input files
+
+// loadGoldenImage - Read the golden image for --verify
+static void loadGoldenImage(const std::string& fileName)
+{
+    try {
+        inFileName = fileName;
+        bool uf2 = isUf2FileName(fileName);
+        InputFile inFile(fileName, uf2);
+        if (uf2) {
+            processUf2File(inFile.stream(), goldenImage);
+        } else {
+            processHexFile(inFile.stream(), goldenImage);
+        }
+    } catch (const std::exception& e) {
+        throwError(std::format("Golden image {}: {}", fileName, e.what()).c_str());
+    }
+}
+
+// processInput - Read and summarize one input file (or stdin if fileArg is null,
+// or a file from an archive if member isn't null), and write any output files
+// Returns the image, which is either parsed into info or shared with the image
+// cache (and kept by cachedImage).
+static const ImageInfo& processInput(const char* fileArg, const ArchiveMember* member, std::ostream& out, ImageInfo& info,
+    ImageCache::ImagePtr& cachedImage)
+{
+    bool inFromFile = (fileArg != nullptr);
+    inFileName = member ? member->name : inFromFile ? fileArg : "stdin";
+    bool inUf2 = (inFromFile || member) && isUf2FileName(inFileName);
+    FileIdentity fileId;
+    bool useCache = imageCache && inFromFile && getFileIdentity(fileArg, fileId);
+    std::optional<InputFile> inFile;
+    std::optional<MemoryStreamBuf> memberStreamBuf;
+    std::istream memberInput(nullptr);
+    if (member) {
+        memberInput.rdbuf(&memberStreamBuf.emplace(member->data.data(), member->data.size()));
+    } else if (inFromFile && !useCache) {
+        TraceSpan span("open", inFileName);
+        inFile.emplace(inFileName, inUf2);
+    }
+    if (inUf2 && multiImage) {
+        throwError("--multi can only be used with hex files");
+    }
+    out << std::format("{} file: {}\n", inUf2 ? "UF2" : "HEX", inFileName);
+    PROBE1(file__start, inFileName.c_str());
+    // The hex text is kept in memory if the output is made from it.
+    ReadStream textInput;
+    std::string_view text;
+    const ImageInfo* image = &info;
+    if (useCache) {
+        cachedImage = imageCache->get(fileId, [&] {
+            TraceSpan span("open", inFileName);
+            InputFile cacheInFile(inFileName, inUf2);
+            span.end();
+            CachedImage image;
+            std::ostringstream parseOut;
+            parseInput(cacheInFile.stream(), inUf2, image.info, parseOut, textInput);
+            image.parseOutput = std::move(parseOut).str();
+            image.text = std::move(textInput).str();
+            return image;
+        });
+        out << cachedImage->parseOutput;
+        text = cachedImage->text;
+        if (rebase || insertCrc) {
+            // These change the image, so they get a copy.
+            info = cachedImage->info;
+        } else {
+            image = &cachedImage->info;
+        }
+    } else {
+        parseInput(member ? memberInput : inFile ? inFile->stream() : std::cin, inUf2, info, out, textInput);
+        text = textInput.view();
+    }
+    TraceSpan reportSpan("report", inFileName);
+    printImageInfo(*image, out);
+    if (!mapFileName.empty()) {
+        printMapInfo(*image, linkerMap, mapFileName, out);
+    }
+    if (showEntropy) {
+        printEntropyInfo(*image, entropyPageSize, minEntropy, maxEntropy, out);
+    }
+    reportSpan.end();
+    TraceSpan outputSpan("output", inFileName);
+    if (insertCrc) {
+        applyCrcInsertion(info, text, out);
+    } else if (rebase) {
+        writeRebasedHexFile(info, text, outFileName, rebaseOffset, out);
+    } else if (!outFileName.empty()) {
+        std::ofstream outFile(outFileName, std::ios::out);
+        if (outFile.fail()) {
+            throwFileError("Failed to create file", outFileName);
+        }
+        writeHexFile(*image, outFile);
+        outFile.close();
+        if (outFile.fail()) {
+            throwFileError("Error writing file", outFileName);
+        }
+        out << std::format("HEX file written: {}\n", outFileName);
+    }
+    if (!uf2FileName.empty()) {
+        writeUf2File(*image, uf2FileName, uf2FamilyId, out);
+    }
+#ifdef __linux__
+    if (!memfdSocketName.empty()) {
+        sendImageMemfd(*image, memfdSocketName, out);
+    }
+#endif
+    outputSpan.end();
+    if (!verifyFileName.empty()) {
+        TraceSpan span("verify", inFileName);
+        if (!printVerifyInfo(*image, goldenImage, verifyFileName, out)) {
+            throwError(std::format("Image doesn't match {}", verifyFileName).c_str());
+        }
+    }
+    PROBE3(file__end, inFileName.c_str(), image->numDataRecords, image->chunks.size());
+    return *image;
+}
+
+// processFile - Process one input file (or a file from an archive), and count it
+// in the metrics and timings
+static void processFile(const char* fileArg, std::ostream& out, const ArchiveMember* member = nullptr)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    // The memory counts must be in place before info is made and until after it's freed.
+    MemoryUsage memoryUsage;
+    struct UsageScope
+    {
+        UsageScope(MemoryUsage* usage) { threadMemoryUsage = usage; }
+        ~UsageScope() { threadMemoryUsage = nullptr; }
+    } usageScope(&memoryUsage);
+    ImageInfo info;
+    ImageCache::ImagePtr cachedImage;
+    const ImageInfo* image = &info;
+    uint64_t fileSize = 0;
+    if (threadProgress) {
+        fileSize = member ? member->data.size() : fileSizeOrZero(fileArg);
+        threadProgress->bytesDone = 0;
+        threadProgress->fileSize = fileSize;
+        threadProgress->fileName = member ? member->name.c_str() : fileArg ? fileArg : "stdin";
+    }
+    auto countFile = [&](bool ok) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        if (threadProgress) {
+            // Count the rest of the file if it wasn't all read, so the total adds up.
+            uint64_t bytesDone = threadProgress->bytesDone.exchange(0);
+            if (fileSize > bytesDone) {
+                progressBytesDone += fileSize - bytesDone;
+            }
+            threadProgress->fileName = nullptr;
+            ++progressFilesDone;
+        }
+        if (!metricsFileName.empty()) {
+            countFileMetrics(*image, ok, elapsed.count());
+        }
+        if (numSlowestFiles > 0) {
+            fileTimings.get().push_back({ member ? member->name : fileArg ? fileArg : "stdin", elapsed.count(),
+                image->inputSize, image->chunks.size() });
+        }
+    };
+    try {
+        image = &processInput(fileArg, member, out, info, cachedImage);
+    } catch (...) {
+        countFile(false);
+        throw;
+    }
+    countFile(true);
+    if (showStats) {
+        printMemoryUsage(memoryUsage, out);
+#ifdef __linux__
+        if (fileArg && !member) {
+            out << std::format("Page cache: {} of {} bytes of the input file resident\n",
+                getPageCacheResidency(fileArg), fileSizeOrZero(fileArg));
+        }
+#endif
+    }
+}
+
+// processFiles - Process several input files using a number of worker threads
+// The output for each file is collected and shown in the order of the files.
+// Archives are read on another thread, which queues their files for the
+// workers as it goes, up to a limit on the memory they take.
+// Returns false if there was an error in any file.
+static bool processFiles(const std::vector<const char*>& fileArgs, unsigned numThreads)
+{
+    struct Job
+    {
+        const char* fileArg = nullptr;
+        std::unique_ptr<ArchiveMember> member;
+        size_t iResult = 0;
+    };
+    struct Result
+    {
+        std::string output;
+        std::string error;
+        bool done = false;
+    };
+    const uint64_t maxQueuedBytes = uint64_t(64) << 20;
+    // Results are only added at the end, so references to them stay valid.
+    std::deque<Result> results;
+    std::deque<Job> jobs;
+    uint64_t queuedBytes = 0;
+    bool allQueued = false;
+    std::mutex mutex;
+    std::condition_variable jobQueued;
+    std::condition_variable jobTaken;
+    std::condition_variable resultDone;
+    auto queueJob = [&](Job job) {
+        std::unique_lock lock(mutex);
+        uint64_t size = job.member ? job.member->data.size() : 0;
+        jobTaken.wait(lock, [&] { return queuedBytes == 0 || queuedBytes + size <= maxQueuedBytes; });
+        queuedBytes += size;
+        job.iResult = results.size();
+        results.emplace_back();
+        jobs.push_back(std::move(job));
+#ifndef _WIN32
+        // A worker that's held back by the governor mustn't be the only one woken.
+        if (workerGovernor) {
+            jobQueued.notify_all();
+            return;
+        }
+#endif
+        jobQueued.notify_one();
+    };
+    auto reader = [&] {
+        setTraceThreadName("reader");
+        for (const char* fileArg : fileArgs) {
+            if (getArchiveType(fileArg) == archiveNone) {
+                queueJob({ fileArg, nullptr, 0 });
+                continue;
+            }
+            try {
+                TraceSpan span("read archive", fileArg);
+                readArchive(fileArg, [&](std::unique_ptr<ArchiveMember> member) {
+                    if (workerProgress) {
+                        ++progressFilesTotal;
+                        progressBytesTotal += member->data.size();
                     }
-                    if (fAdded) {
-                        // Check if the new chunk needs to merge with the
-                        // following one as well.
-                        auto next = iter;
-                        if (++next != chunks.end()) {
-                            if (checkMergeChunk(*iter, next)) {
-                                chunks.erase(iter);
-                            }
+                    queueJob({ nullptr, std::move(member), 0 });
+                });
+            } catch (const std::exception& e) {
+                std::lock_guard lock(mutex);
+                results.push_back({ "", std::format("{}: Error: {}\n", progName, e.what()), true });
+                resultDone.notify_all();
+            }
+        }
+        std::lock_guard lock(mutex);
+        allQueued = true;
+        jobQueued.notify_all();
+        resultDone.notify_all();
+    };
+    auto worker = [&](unsigned iThread) {
+        setTraceThreadName(std::format("worker {}", iThread + 1));
+        if (workerProgress) {
+            threadProgress = &workerProgress[iThread];
+        }
+        for (;;) {
+            std::unique_lock lock(mutex);
+            jobQueued.wait(lock, [&] { return !jobs.empty() || allQueued; });
+            if (jobs.empty()) {
+                break;
+            }
+#ifndef _WIN32
+            if (workerGovernor && !workerGovernor->mayWork(iThread)) {
+                jobQueued.wait_for(lock, WorkerGovernor::checkInterval);
+                continue;
+            }
+#endif
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            std::ostringstream out;
+            std::string error;
+            try {
+                processFile(job.fileArg, out, job.member.get());
+            } catch (const std::exception& e) {
+                error = std::format("{}: Error: {}\n", progName, e.what());
+            } catch (...) {
+                error = std::format("{}: Error\n", progName);
+            }
+            uint64_t size = job.member ? job.member->data.size() : 0;
+            job.member.reset();
+            lock.lock();
+            queuedBytes -= size;
+            jobTaken.notify_all();
+            Result& result = results[job.iResult];
+            result.output = std::move(out).str();
+            result.error = std::move(error);
+            result.done = true;
+            resultDone.notify_all();
+        }
+    };
+    std::jthread readerThread(reader);
+    std::vector<std::jthread> threads;
+    for (unsigned iThread = 0; iThread < std::max(numThreads, 1u); ++iThread) {
+        threads.emplace_back(worker, iThread);
+    }
+    bool ok = true;
+    for (size_t iResult = 0;; ++iResult) {
+        std::unique_lock lock(mutex);
+        resultDone.wait(lock, [&] { return (iResult < results.size() && results[iResult].done) || (allQueued && iResult >= results.size()); });
+        if (iResult >= results.size()) {
+            break;
+        }
+        Result& result = results[iResult];
+        lock.unlock();
+        std::cout << result.output << std::flush;
+        if (!result.error.empty()) {
+            std::cerr << result.error;
+            ok = false;
+        }
+        // Each result's output is freed once it's shown.
+        result.output = {};
+    }
+    return ok;
+}
+
+// Host calibration
+// --calibrate times the parser on a synthetic corpus of hex files with each of
+// the candidate I/O modes, read buffer sizes and numbers of worker threads, and
+// saves the fastest in the host config file. Later runs read that file at
+// startup, and options on the command line override it. The corpus is written
+// to the temporary directory (TMPDIR), so that should be on the same kind of
+// storage as the real input files, and it's dropped from the page cache before
+// each run so it's read from storage like a new batch.
+
+// getHostConfigPath - Get the path of the host config file, or an empty path if
+// there's nowhere to put it
+// HEXFILEINFO_CONFIG overrides the usual per-user location.
+static std::filesystem::path getHostConfigPath()
+{
+    if (const char* path = std::getenv("HEXFILEINFO_CONFIG"); path && *path) {
+        return path;
+    }
+#ifdef _WIN32
+    if (const char* dir = std::getenv("LOCALAPPDATA"); dir && *dir) {
+        return std::filesystem::path(dir) / "HexFileInfo" / "host.conf";
+    }
+#else
+    if (const char* dir = std::getenv("XDG_CONFIG_HOME"); dir && *dir) {
+        return std::filesystem::path(dir) / "hexfileinfo" / "host.conf";
+    }
+    if (const char* home = std::getenv("HOME"); home && *home) {
+        return std::filesystem::path(home) / ".config" / "hexfileinfo" / "host.conf";
+    }
+#endif
+    return {};
+}
+
+// loadHostConfig - Use the settings in the host config file, if there is one
+// A missing file costs only the failed open, with no separate check. Each line
+// is SETTING = VALUE, where SETTING is io, read-buffer or jobs, the same as the
+// command-line options. Blank lines, lines starting with # and unknown settings
+// are ignored.
+static void loadHostConfig()
+{
+    std::filesystem::path path = getHostConfigPath();
+    std::ifstream file;
+    if (!path.empty()) {
+        file.open(path);
+    }
+    if (!file.is_open()) {
+        return;
+    }
+    auto trim = [](std::string_view str) {
+        size_t start = str.find_first_not_of(" \t\r");
+        return start == std::string_view::npos ? std::string_view() : str.substr(start, str.find_last_not_of(" \t\r") + 1 - start);
+    };
+    std::string line;
+    for (unsigned lineNum = 1; std::getline(file, line); ++lineNum) {
+        std::string_view text = trim(line);
+        if (text.empty() || text.starts_with('#')) {
+            continue;
+        }
+        size_t equals = text.find('=');
+        std::string_view name = trim(text.substr(0, equals));
+        std::string value(equals == std::string_view::npos ? std::string_view() : trim(text.substr(equals + 1)));
+        try {
+            if (equals == std::string_view::npos) {
+                throwError("Expected SETTING = VALUE");
+            } else if (name == "io") {
+                ioMode = parseIoMode(value);
+            } else if (name == "read-buffer") {
+                readBufferSize = parseReadBufferSize(value.c_str());
+            } else if (name == "jobs") {
+                numJobs = parseNumber(value.c_str());
+            }
+        } catch (const std::exception& e) {
+            throwError(std::format("{} line {}: {}", path.string(), lineNum, e.what()).c_str());
+        }
+    }
+}
+
+// writeHostConfig - Save the current settings in the host config file
+static void writeHostConfig(const std::filesystem::path& path)
+{
+    if (path.has_parent_path()) {
+        std::filesystem::create_directories(path.parent_path());
+    }
+    std::ofstream file(path);
+    file << "# Settings for this host, written by HexFileInfo --calibrate\n";
+    file << "# Options on the command line override them.\n";
+    file << std::format("io = {}\n", ioModeNames[ioMode]);
+    if (readBufferSize > 0) {
+        file << std::format("read-buffer = {}\n", readBufferSize);
+    }
+    file << std::format("jobs = {}\n", numJobs);
+    file.close();
+    if (file.fail()) {
+        throwFileError("Error writing file", path.string());
+    }
+}
+
+// writeCalibrationCorpus - Write the synthetic hex files for calibration
+// Each file has a few segments of random data, like code and data in flash.
+static std::vector<std::string> writeCalibrationCorpus(const std::filesystem::path& dir, unsigned numFiles)
+{
+    const unsigned numSegments = 4;
+    const unsigned segmentSize = 0x10000;
+    std::filesystem::create_directories(dir);
+    std::minstd_rand random(1);
+    std::vector<std::string> fileNames;
+    for (unsigned iFile = 0; iFile < numFiles; ++iFile) {
+        ImageInfo info;
+        for (unsigned iSegment = 0; iSegment < numSegments; ++iSegment) {
+            Chunk chunk{ 0x08000000 + iSegment * 2 * segmentSize, segmentSize, {} };
+            chunk.data.resize(segmentSize);
+            for (unsigned char& byte : chunk.data) {
+                byte = static_cast<unsigned char>(random() >> 8);
+            }
+            info.chunks.push_front(std::move(chunk)); // the list is in descending order
+        }
+        std::string fileName = (dir / std::format("{}.hex", iFile + 1)).string();
+        std::ofstream file(fileName);
+        writeHexFile(info, file);
+        file.close();
+        if (file.fail()) {
+            throwFileError("Error writing file", fileName);
+        }
+        fileNames.push_back(std::move(fileName));
+    }
+    return fileNames;
+}
+
+// evictFromPageCache - Drop files from the page cache (Linux only)
+// File systems that only live in memory, like tmpfs, keep them anyway.
+static void evictFromPageCache(const std::vector<std::string>& fileNames)
+{
+#ifdef __linux__
+    for (const std::string& fileName : fileNames) {
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            // Only clean pages can be dropped.
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+#endif
+}
+
+// timeCalibrationRun - Parse the files with numThreads threads and the current
+// settings, and return the best time of a few runs in seconds
+static double timeCalibrationRun(const std::vector<std::string>& fileNames, unsigned numThreads)
+{
+    const unsigned numRuns = 3;
+    double bestSeconds = INFINITY;
+    for (unsigned iRun = 0; iRun < numRuns; ++iRun) {
+        evictFromPageCache(fileNames);
+        std::atomic<size_t> nextFile = 0;
+        std::vector<std::exception_ptr> errors(numThreads);
+        auto startTime = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> threads;
+            for (unsigned iThread = 0; iThread < numThreads; ++iThread) {
+                threads.emplace_back([&, iThread] {
+                    try {
+                        for (size_t iFile; (iFile = nextFile++) < fileNames.size();) {
+                            inFileName = fileNames[iFile];
+                            InputFile inFile(fileNames[iFile], false);
+                            ImageInfo info;
+                            processHexFile(inFile.stream(), info, false);
                         }
-                        break;
+                    } catch (...) {
+                        errors[iThread] = std::current_exception();
                     }
-                }
-                if (!fAdded) {
-                    chunks.push_front(chunk);
-                }
-                ++numDataRecords;
-                maxDataSize = std::max(maxDataSize, dataSize);
-                break;
+                });
             }
-            ++iLine;
         }
-        if (!input.eof()) {
-            throwFileError("Error reading file");
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        for (const std::exception_ptr& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
         }
-    } catch (const std::exception& e) {
-        // Re-throw the exception with added context
-        std::string str = std::format("{}\nLine {}: {}", e.what(), iLine, makePrintable(stLine));
-        throwError(str.c_str());
+        bestSeconds = std::min(bestSeconds, elapsed.count());
     }
-    if (!foundEof) {
-        std::cout << "Missing EOF record\n";
+    return bestSeconds;
+}
+
+// calibrateSetting - Time each candidate value of a setting and return the fastest
+// The first candidate is the default, which is kept unless another one is
+// clearly faster, so noise in the timings doesn't change the settings.
+template<typename T>
+static T calibrateSetting(const char* name, const std::vector<T>& candidates, const auto& apply, const auto& formatValue,
+    const std::vector<std::string>& fileNames, uint64_t corpusSize, std::ostream& out)
+{
+    out << std::format("{}:\n", name);
+    std::vector<double> times;
+    for (const T& candidate : candidates) {
+        unsigned numThreads = apply(candidate);
+        times.push_back(timeCalibrationRun(fileNames, numThreads));
+        out << std::format("  {:>9}  {}/s\n", formatValue(candidate), formatByteCount(double(corpusSize) / times.back())) << std::flush;
     }
-    if (numStartAddresses > 1) {
-        std::cout << "Multiple start addresses found\n";
-    } else if (numStartAddresses > 0) {
-        std::cout << std::format("Start address: 0x{:X}\n", startAddress);
+    size_t iBest = size_t(std::ranges::min_element(times) - times.begin());
+    if (times[iBest] > times[0] * 0.95) {
+        iBest = 0;
     }
-    std::cout << std::format("{} data records, max size {}\n", numDataRecords, maxDataSize);
-    std::cout << std::format("{} data segments", chunks.size());
-    if (numOverlapping > 0) {
-        std::cout << std::format(", {} overlaps found", numOverlapping);
+    apply(candidates[iBest]);
+    return candidates[iBest];
+}
+
+// runCalibration - Find the fastest settings for this host and save them in the
+// host config file
+static void runCalibration(std::ostream& out)
+{
+    std::filesystem::path configPath = getHostConfigPath();
+    if (configPath.empty()) {
+        throwError("No location for the host config file; set HEXFILEINFO_CONFIG");
     }
-    std::cout << ":\n";
-    // Display the chunks in reverse order because they were added in reverse order.
-    for (const Chunk& chunk : std::ranges::reverse_view(chunks)) {
-        std::cout << std::format("start 0x{:X} size 0x{:X}\n", chunk.address, chunk.size);
+    unsigned numCores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned numFiles = std::clamp(4 * numCores, 16u, 256u);
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / std::format("hexfileinfo-calibrate-{}", std::random_device()());
+    struct RemoveDir
+    {
+        std::filesystem::path dir;
+        ~RemoveDir()
+        {
+            std::error_code ec;
+            std::filesystem::remove_all(dir, ec);
+        }
+    } removeDir{ dir };
+    std::vector<std::string> fileNames = writeCalibrationCorpus(dir, numFiles);
+    uint64_t corpusSize = 0;
+    for (const std::string& fileName : fileNames) {
+        corpusSize += fileSizeOrZero(fileName.c_str());
     }
+    out << std::format("Calibrating with {} files ({}) in {}\n", numFiles, formatByteCount(double(corpusSize)), dir.string()) << std::flush;
+
+    // Each setting is timed with the best of the settings before it.
+    ioMode = ioBuffered;
+    readBufferSize = 0;
+    std::vector<ioMode_t> modes = { ioBuffered };
+#ifdef __linux__
+    modes.insert(modes.end(), { ioDirect, ioHot });
+#endif
+    calibrateSetting("I/O mode", modes, [](ioMode_t mode) { ioMode = mode; return 1u; },
+        [](ioMode_t mode) { return std::string(ioModeNames[mode]); }, fileNames, corpusSize, out);
+    // A mapped file has no read buffer.
+    if (ioMode != ioHot) {
+        size_t defaultSize = InputFile::defaultBufferSize;
+#ifdef __linux__
+        if (ioMode != ioBuffered) {
+            defaultSize = FileStreamBuf::defaultBufferSize;
+        }
+#endif
+        std::vector<size_t> sizes = { defaultSize };
+        for (size_t size : { 0x4000, 0x10000, 0x40000, 0x100000, 0x400000 }) {
+            if (size != defaultSize) {
+                sizes.push_back(size);
+            }
+        }
+        calibrateSetting("Read buffer", sizes, [](size_t size) { readBufferSize = size; return 1u; },
+            [](size_t size) { return size >= 0x100000 ? std::format("{} MiB", size >> 20) : std::format("{} KiB", size >> 10); }, fileNames, corpusSize, out);
+    }
+    std::vector<unsigned> jobCounts = { numCores };
+    for (unsigned count = 1; count < numCores; count *= 2) {
+        jobCounts.push_back(count);
+    }
+    // More threads than cores can hide the latency of network storage.
+    jobCounts.push_back(2 * numCores);
+    calibrateSetting("Jobs", jobCounts, [](unsigned count) { numJobs = count; return count; },
+        [](unsigned count) { return std::format("{}", count); }, fileNames, corpusSize, out);
+
+    writeHostConfig(configPath);
+    out << std::format("Saved in {}:\n", configPath.string());
+    std::ifstream config(configPath);
+    out << config.rdbuf();
 }
 
 int main(int argc, char* argv[])
 {
+    auto startTime = std::chrono::steady_clock::now();
+    int exitCode = 0;
     try {
+        // The report is written in one go at the end (or as the buffer fills),
+        // not a line at a time on a terminal. Output to stderr flushes it first.
+        std::setvbuf(stdout, nullptr, _IOFBF, 0x10000);
         if (argc > 0) {
-            progName = std::filesystem::path(argv[0]).stem().string();
-        }
-        std::ifstream inFile;
-        bool inFromFile = false;
-        if (argc == 1) {
-            // Input from stdin
-            inFromFile = false;
-            inFileName = "stdin";
-        } else if (argc == 2) {
-            // Open input file
-            inFromFile = true;
-            inFileName = argv[1];
-            inFile.open(inFileName, std::ios::in);
-            if (inFile.fail()) {
-                throwFileError("Failed to open file");
+            // The program name without its directory or extension
+            std::string_view name = argv[0];
+            name = name.substr(name.find_last_of("/\\") + 1);
+            progName = name.substr(0, std::min(name.rfind('.'), name.size()));
+            if (progName.empty()) {
+                progName = name;
+            }
+        }
+        // Settings from --calibrate come first, so the command line overrides them.
+        // They aren't read for --calibrate itself, which replaces them, or when
+        // the command line sets all of them anyway.
+        auto hasOption = [&](std::string_view option) {
+            return std::any_of(argv + 1, argv + argc, [&](const char* arg) { return std::string_view(arg) == option; });
+        };
+        bool calibrate = hasOption("--calibrate");
+        if (!calibrate && !(hasOption("--io") && hasOption("--read-buffer") && hasOption("--jobs"))) {
+            loadHostConfig();
+        }
+        // Parse the command line
+        std::vector<const char*> inFileArgs;
+        for (int iArg = 1; iArg < argc; ++iArg) {
+            std::string_view arg = argv[iArg];
+            bool hasValue = iArg + 1 < argc;
+            if (arg == "--uf2" && hasValue) {
+                uf2FileName = argv[++iArg];
+            } else if (arg == "--memfd" && hasValue) {
+#ifndef __linux__
+                throwError("--memfd is only supported on Linux");
+#endif
+                memfdSocketName = argv[++iArg];
+            } else if (arg == "--family" && hasValue) {
+                uf2FamilyId = parseNumber(argv[++iArg]);
+            } else if (arg == "--multi") {
+                multiImage = true;
+            } else if (arg == "--rebase" && hasValue) {
+                rebase = true;
+                rebaseOffset = parseOffset(argv[++iArg]);
+            } else if (arg == "--insert-crc" && hasValue) {
+                insertCrc = true;
+                crcAddress = parseNumber(argv[++iArg]);
+            } else if (arg == "--range" && hasValue) {
+                parseAddressRange(argv[++iArg], crcRangeStart, crcRangeEnd);
+            } else if (arg == "--fill" && hasValue) {
+                unsigned fill = parseNumber(argv[++iArg]);
+                if (fill > 0xFF) {
+                    throwError("Invalid fill byte");
+                }
+                crcFill = static_cast<unsigned char>(fill);
+            } else if ((arg == "--output" || arg == "-o") && hasValue) {
+                outFileName = argv[++iArg];
+            } else if (arg == "--verify" && hasValue) {
+                verifyFileName = argv[++iArg];
+            } else if (arg == "--ignore" && hasValue) {
+                unsigned start;
+                uint64_t end;
+                parseAddressRange(argv[++iArg], start, end);
+                addIgnoreRange(start, end);
+            } else if (arg == "--map" && hasValue) {
+                mapFileName = argv[++iArg];
+            } else if (arg == "--entropy") {
+                showEntropy = true;
+            } else if (arg == "--entropy-page" && hasValue) {
+                showEntropy = true;
+                entropyPageSize = parseNumber(argv[++iArg]);
+                if (entropyPageSize == 0) {
+                    throwError("Invalid page size");
+                }
+            } else if (arg == "--entropy-range" && hasValue) {
+                showEntropy = true;
+                parseRange(argv[++iArg], minEntropy, maxEntropy);
+            } else if (arg == "--jobs" && hasValue) {
+                numJobs = parseNumber(argv[++iArg]);
+            } else if (arg == "--trace" && hasValue) {
+                traceFileName = argv[++iArg];
+                traceEnabled = true;
+            } else if (arg == "--metrics-file" && hasValue) {
+                metricsFileName = argv[++iArg];
+            } else if (arg == "--slowest" && hasValue) {
+                numSlowestFiles = parseNumber(argv[++iArg]);
+            } else if (arg == "--cache-size" && hasValue) {
+                cacheSizeMB = parseNumber(argv[++iArg]);
+            } else if (arg == "--io" && hasValue) {
+                ioMode = parseIoMode(argv[++iArg]);
+            } else if (arg == "--read-buffer" && hasValue) {
+                readBufferSize = parseReadBufferSize(argv[++iArg]);
+            } else if (arg == "--background") {
+                background = true;
+            } else if (arg == "--max-read-rate" && hasValue) {
+                maxReadRateMB = parseNumber(argv[++iArg]);
+            } else if (arg == "--calibrate") {
+                calibrate = true;
+            } else if (arg == "--progress") {
+                showProgress = true;
+            } else if (arg == "--stats") {
+                showStats = true;
+            } else if (!arg.starts_with('-')) {
+                inFileArgs.push_back(argv[iArg]);
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+        if (rebase && outFileName.empty()) {
+            throwError("--rebase requires --output");
+        }
+        if (insertCrc && crcRangeEnd == 0) {
+            throwError("--insert-crc requires --range");
+        }
+        if (insertCrc && (rebase || multiImage)) {
+            throwError("--insert-crc can't be used with --rebase or --multi");
+        }
+        if (insertCrc && crcAddress < crcRangeEnd && crcRangeStart < uint64_t(crcAddress) + crcInfoSize) {
+            throwError("The CRC address is inside the --range");
+        }
+        if (!ignoreRanges.empty() && verifyFileName.empty()) {
+            throwError("--ignore requires --verify");
+        }
+        setTraceThreadName("main");
+        if (background) {
+            lowerPriority();
+        }
+        if (maxReadRateMB > 0) {
+            readRateLimiter = std::make_unique<RateLimiter>(maxReadRateMB * 1e6);
+        }
+        if (!verifyFileName.empty()) {
+            loadGoldenImage(verifyFileName);
+        }
+        if (!mapFileName.empty()) {
+            linkerMap = loadMapFile(mapFileName);
+        }
+        bool hasArchives = std::ranges::any_of(inFileArgs, [](const char* fileArg) { return getArchiveType(fileArg) != archiveNone; });
+        if (calibrate) {
+            if (!inFileArgs.empty()) {
+                throwError("--calibrate doesn't take input files");
+            }
+            runCalibration(std::cout);
+        } else if (inFileArgs.size() <= 1 && !hasArchives) {
+            const char* fileArg = inFileArgs.empty() ? nullptr : inFileArgs[0];
+            std::optional<ProgressReporter> progressReporter;
+            if (showProgress) {
+                progressReporter.emplace(1, 1, fileSizeOrZero(fileArg));
+                threadProgress = &workerProgress[0];
             }
+            processFile(fileArg, std::cout);
         } else {
-            std::cerr << std::format("Usage: {} [input-file]\n", progName);
-            return 1;
+            if (!outFileName.empty() || !uf2FileName.empty() || !memfdSocketName.empty()) {
+                throwError("Output files can only be written from a single input file");
+            }
+            if (numJobs == 0) {
+                numJobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+            if (!hasArchives) {
+                numJobs = std::min(numJobs, unsigned(inFileArgs.size()));
+            }
+            // The workers share the cores that they don't use themselves.
+            unsigned numCores = std::max(1u, std::thread::hardware_concurrency());
+            HelperThreads::setLimit(numCores > numJobs ? numCores - numJobs : 0);
+            if (cacheSizeMB > 0) {
+                imageCache = std::make_unique<ImageCache>(uint64_t(cacheSizeMB) << 20);
+            }
+#ifndef _WIN32
+            if (background) {
+                workerGovernor = std::make_unique<WorkerGovernor>(numJobs);
+            }
+#endif
+            std::optional<ProgressReporter> progressReporter;
+            if (showProgress) {
+                // Files in archives are counted as they're read.
+                unsigned numFiles = 0;
+                uint64_t totalBytes = 0;
+                for (const char* fileArg : inFileArgs) {
+                    if (getArchiveType(fileArg) == archiveNone) {
+                        ++numFiles;
+                        totalBytes += fileSizeOrZero(fileArg);
+                    }
+                }
+                progressReporter.emplace(numFiles, numJobs, totalBytes);
+            }
+            exitCode = processFiles(inFileArgs, numJobs) ? 0 : 2;
+        }
+        if (numSlowestFiles > 0) {
+            printFileTimings(numSlowestFiles, std::cout);
+        }
+        if (showStats) {
+            std::cout << std::format("Peak resident memory: {} bytes\n", getPeakMemoryUsage());
         }
-        processHexFile(inFromFile ? inFile : std::cin);
     } catch (const std::exception& e) {
         std::cerr << std::format("{}: Error: {}\n", progName, e.what());
-        return 2;
+        exitCode = 2;
     } catch (...) {
         std::cerr << std::format("{}: Error\n", progName);
-        return 2;
+        exitCode = 2;
+    }
+    try {
+        if (traceEnabled) {
+            writeTraceFile(traceFileName);
+        }
+        if (!metricsFileName.empty()) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+            writeMetricsFile(metricsFileName, elapsed.count());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << std::format("{}: Error: {}\n", progName, e.what());
+        exitCode = 2;
     }
-    return 0;
+    return exitCode;
 }
@@ -0,0 +1,928 @@
+/*
+HexFileParser - Parser for Intel HEX and UF2 files (see HexFileParser.h)
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "HexFileParser.h"
+#include <ranges>
+#include <iterator>
+#include <cerrno>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
+thread_local std::string inFileName = "stdin";
+
+void throwError(const char* message)
+{
+    PROBE1(error, message);
+    throw std::runtime_error(message);
+}
+
+void throwFileError(const char* message, const std::string& fileName)
+{
+    throwError(std::format("{} {}", message, fileName).c_str());
+}
+
+void throwFormatError()
+{
+    throwError("Invalid data in hex file");
+}
+
+std::string makePrintable(std::string_view str)
+{
+    const unsigned maxLen = 64;
+    std::string strNew;
+    if (str.size() <= maxLen) {
+        strNew = str;
+    } else {
+        strNew = std::string(str.substr(0, maxLen)) + "[etc]";
+    }
+    for (auto& ch : strNew) {
+        if (!std::isprint(static_cast<unsigned char>(ch))) {
+            ch = '?';
+        }
+    }
+    return strNew;
+}
+
+thread_local constinit MemoryUsage* threadMemoryUsage = nullptr;
+
+// readAll - Read the rest of a stream into memory
+ReadBuffer readAll(std::istream& input)
+{
+    ReadBuffer text(std::istreambuf_iterator<char>(input), {});
+    if (input.bad()) {
+        throwFileError("Error reading file", inFileName);
+    }
+    return text;
+}
+
+FdStreamBuf::int_type FdStreamBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    int size;
+    do {
+#ifdef _WIN32
+        size = _read(fd, buffer.data(), unsigned(buffer.size()));
+#else
+        size = int(::read(fd, buffer.data(), buffer.size()));
+#endif
+    } while (size < 0 && errno == EINTR);
+    if (size < 0) {
+        throwError("Read error");
+    }
+    setg(buffer.data(), buffer.data(), buffer.data() + size);
+    return size > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+}
+
+FileDescriptor::FileDescriptor(const char* path)
+{
+#ifdef _WIN32
+    fd = _open(path, _O_RDONLY | _O_BINARY);
+#else
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        throwFileError("Failed to open file", path);
+    }
+}
+
+FileDescriptor::~FileDescriptor()
+{
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+std::atomic<uint64_t> progressBytesDone = 0;
+thread_local constinit WorkerProgress* threadProgress = nullptr;
+
+static std::atomic<unsigned> helperThreadsAvailable = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+HelperThreads::HelperThreads(size_t wanted)
+{
+    unsigned available = helperThreadsAvailable.load();
+    do {
+        numTaken = unsigned(std::min<size_t>(wanted, available));
+    } while (numTaken > 0 && !helperThreadsAvailable.compare_exchange_weak(available, available - numTaken));
+}
+
+HelperThreads::~HelperThreads()
+{
+    if (numTaken > 0) {
+        helperThreadsAvailable += numTaken;
+    }
+}
+
+void HelperThreads::setLimit(unsigned limit)
+{
+    helperThreadsAvailable = limit;
+}
+
+// SegmentRange - The addresses of one segment
+struct SegmentRange
+{
+    unsigned address;
+    unsigned size;
+};
+
+// splitRun - Divide a run of overlapping records into segments
+// A record that starts inside the data of earlier records starts a segment of
+// its own, so overlapping records are shown as separate ranges. A record that
+// starts where the data so far ends is added to the segment that ends there.
+template <typename Record>
+static void splitRun(std::span<const Record> run, std::vector<SegmentRange>& ranges)
+{
+    uint64_t end = 0;
+    size_t iLast = 0; // the segment that ends at end
+    for (const Record& record : run) {
+        uint64_t recordEnd = uint64_t(record.address) + record.size;
+        if (!ranges.empty() && record.address == end) {
+            ranges[iLast].size += record.size;
+            end = recordEnd;
+        } else {
+            ranges.push_back({ record.address, record.size });
+            if (recordEnd > end) {
+                iLast = ranges.size() - 1;
+                end = recordEnd;
+            }
+        }
+    }
+}
+
+// makeSegments - Make the segments of an image from its data records
+// The records are sorted by address (unless isSorted says they are already),
+// keeping records at the same address in file order. Each run of contiguous or
+// overlapping records is passed to makeRun with its address and size, and its
+// segments: the whole run if none of its records overlap, or else the ranges
+// made by splitRun. A record that starts inside the data of earlier records in
+// its run is counted as an overlap. The eager parser and LazyImage both use
+// this, so they make the same segments and counts.
+template <typename Record, typename MakeRun>
+static void makeSegments(std::span<Record> records, bool isSorted, ImageInfo& info, MakeRun&& makeRun)
+{
+    if (!isSorted) {
+        std::ranges::stable_sort(records, {}, &Record::address);
+    }
+    std::vector<SegmentRange> ranges;
+    for (size_t first = 0; first < records.size();) {
+        unsigned address = records[first].address;
+        uint64_t end = uint64_t(address) + records[first].size;
+        bool overlapped = false;
+        size_t last = first + 1;
+        for (; last < records.size() && records[last].address <= end; ++last) {
+            const Record& record = records[last];
+            if (record.address < end) {
+                PROBE4(overlap, record.address, record.size, address, unsigned(end - address));
+                ++info.numOverlapping;
+                overlapped = true;
+            } else {
+                PROBE3(chunk__merge, record.address, record.size, address);
+            }
+            end = std::max(end, uint64_t(record.address) + record.size);
+        }
+        std::span<Record> run = records.subspan(first, last - first);
+        ranges.clear();
+        if (overlapped) {
+            splitRun(std::span<const Record>(run), ranges);
+        } else {
+            ranges.push_back({ address, unsigned(end - address) });
+        }
+        makeRun(run, address, unsigned(end - address), std::span<const SegmentRange>(ranges));
+        first = last;
+    }
+}
+
+// ChunkBuilder - Collects the data records of an image, and makes its chunks
+// The records are listed in file order with their data appended to one buffer,
+// so adding a record doesn't allocate memory for it or move data that's already
+// in place. finish() sorts the records by address if they weren't in order
+// already, and makes the chunks by appending the data of each run of contiguous
+// records. Where records overlap, each chunk has the data of the image at its
+// addresses, where the record later in the file wins.
+class ChunkBuilder
+{
+public:
+    explicit ChunkBuilder(bool keepData) : keepData(keepData) {}
+
+    // add - Add a data record, and return where to put its data (null if the
+    // data isn't kept)
+    unsigned char* add(unsigned address, unsigned size)
+    {
+        if (size == 0) {
+            return nullptr;
+        }
+        isSorted = isSorted && (records.empty() || address >= records.back().address);
+        records.push_back({ address, size, bytes.size() });
+        if (!keepData) {
+            return nullptr;
+        }
+        bytes.resize(bytes.size() + size);
+        return bytes.data() + records.back().offset;
+    }
+
+    // finish - Make the chunks, and count the overlapping records
+    void finish(ImageInfo& info)
+    {
+        // The chunks are made in order of address, and pushed on the front of the list.
+        makeSegments(std::span(records), isSorted, info, [&](std::span<Record> runRecords, unsigned address, unsigned size,
+            std::span<const SegmentRange> segments)
+        {
+            if (segments.size() == 1) {
+                Chunk chunk{ address, size, {} };
+                if (keepData) {
+                    fillChunk(chunk, runRecords);
+                }
+                PROBE2(chunk__insert, chunk.address, chunk.size);
+                info.chunks.push_front(std::move(chunk));
+                return;
+            }
+            Chunk run{ address, size, {} };
+            if (keepData) {
+                fillOverlapped(run, runRecords);
+            }
+            for (const SegmentRange& segment : segments) {
+                Chunk chunk{ segment.address, segment.size, {} };
+                if (keepData) {
+                    auto data = run.data.begin() + (segment.address - address);
+                    chunk.data.assign(data, data + segment.size);
+                }
+                PROBE2(chunk__insert, chunk.address, chunk.size);
+                info.chunks.push_front(std::move(chunk));
+            }
+        });
+    }
+
+private:
+    struct Record
+    {
+        unsigned address;
+        unsigned size;
+        size_t offset; // of the data in bytes
+    };
+
+    // fillOverlapped - Copy the data of a run of overlapping records into a chunk
+    // that covers them all
+    void fillOverlapped(Chunk& chunk, std::span<Record> runRecords)
+    {
+        // Later records in the file overwrite earlier ones, and the data was
+        // added in file order.
+        std::ranges::sort(runRecords, {}, &Record::offset);
+        chunk.data.resize(chunk.size);
+        for (const Record& record : runRecords) {
+            std::memcpy(chunk.data.data() + (record.address - chunk.address), bytes.data() + record.offset, record.size);
+        }
+    }
+
+    // fillChunk - Copy the data of a run of contiguous records into their chunk
+    void fillChunk(Chunk& chunk, std::span<Record> chunkRecords)
+    {
+        if (isSorted) {
+            // The data is already in order, in one piece.
+            size_t offset = chunkRecords.front().offset;
+            if (offset == 0 && chunk.size == bytes.size()) {
+                chunk.data = std::move(bytes);
+            } else {
+                chunk.data.assign(bytes.begin() + offset, bytes.begin() + offset + chunk.size);
+            }
+        } else {
+            chunk.data.reserve(chunk.size);
+            for (const Record& record : chunkRecords) {
+                chunk.data.insert(chunk.data.end(), bytes.begin() + record.offset, bytes.begin() + record.offset + record.size);
+            }
+        }
+    }
+
+    bool keepData;
+    bool isSorted = true;
+    std::vector<Record, CountingAllocator<Record, memChunks>> records;
+    ChunkData bytes;
+};
+
+const unsigned dataOffset = 1 + 2 + 4 + 2; // ':' + count + address + type
+const unsigned minLineSize = dataOffset + 0 + 2; // ... + no data + checksum
+const unsigned maxLineSize = minLineSize + 2 * 255; // max data = 255 bytes
+
+// decodeHexBytes - Decode pairs of hex digits, and return the sum of the bytes
+// (for the checksum). The bytes are stored in out unless it's null.
+static unsigned char decodeHexBytes(std::span<const char> hex, unsigned char* out)
+{
+    unsigned char sum = 0;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        int high = hexDigitValues[static_cast<unsigned char>(hex[i])];
+        int low = hexDigitValues[static_cast<unsigned char>(hex[i + 1])];
+        if ((high | low) < 0) throwFormatError();
+        unsigned char byte = static_cast<unsigned char>(high * 16 + low);
+        sum += byte;
+        if (out) {
+            out[i / 2] = byte;
+        }
+    }
+    return sum;
+}
+
+// HexRecord - One record of a hex file, with its header decoded
+struct HexRecord
+{
+    recordType_t type;
+    unsigned address; // including the base address
+    unsigned dataSize;
+    std::span<const char> data; // the hex digits
+    std::span<const char> line;
+};
+
+// parseRecord - Check the format of a line of a hex file, and decode its header
+// (the checksum is checked by checkRecord)
+static HexRecord parseRecord(std::span<const char> line, unsigned baseAddress)
+{
+    if (line.size() < minLineSize) throwFormatError();
+    if (line.size() > maxLineSize) throwFormatError();
+    if (line.front() != ':') throwFormatError();
+    unsigned dataSize = fromHex(line.subspan(1, 2));
+    if (line.size() != minLineSize + 2 * dataSize) throwFormatError();
+    return { recordType_t(fromHex(line.subspan(7, 2))), baseAddress + fromHex(line.subspan(3, 4)), dataSize,
+        line.subspan(dataOffset, 2 * dataSize), line };
+}
+
+// checkRecord - Check the checksum of a record, decoding its data into out
+// unless it's null
+static void checkRecord(const HexRecord& record, unsigned char* out)
+{
+    unsigned char checksum = decodeHexBytes(record.line.subspan(1, dataOffset - 1), nullptr)
+        + decodeHexBytes(record.data, out) + decodeHexBytes(record.line.last(2), nullptr);
+    if (checksum != 0) throwError("Incorrect checksum");
+}
+
+// handleRecord - Handle a record that has been checked, and count it in the image info
+// Data records are only counted; the caller keeps track of their data.
+static void handleRecord(const HexRecord& record, ImageInfo& info, unsigned& baseAddress)
+{
+    switch (record.type) {
+    default:
+        // Bad record type
+        throwFormatError();
+    case typeEof:
+        // End-of-file record
+        if (record.dataSize != 0) throwFormatError();
+        info.foundEof = true;
+        break;
+    case typeEsa:
+        // Base address segment
+        if (record.dataSize != 2) throwFormatError();
+        baseAddress = fromHex(record.data) << 4;
+        info.hasSegmentRecords = true;
+        break;
+    case typeSsa:
+        // Start address CS:IP
+        if (record.dataSize != 4) throwFormatError();
+        info.startAddress = (fromHex(record.data.first(4)) << 4) + fromHex(record.data.last(4));
+        ++info.numStartAddresses;
+        info.hasSegmentRecords = true;
+        break;
+    case typeEla:
+        // Base address linear
+        if (record.dataSize != 2) throwFormatError();
+        baseAddress = fromHex(record.data) << 16;
+        break;
+    case typeSla:
+        // Start address linear
+        if (record.dataSize != 4) throwFormatError();
+        info.startAddress = fromHex(record.data);
+        ++info.numStartAddresses;
+        break;
+    case typeData:
+        // Data record
+        ++info.numDataRecords;
+        info.maxDataSize = std::max(info.maxDataSize, record.dataSize);
+        break;
+    }
+    ++info.recordCounts[record.type];
+}
+
+// processHexFile - Read a hex file, or one image of a multi-image file
+// starting at the given line number
+void processHexFile(std::istream& input, ImageInfo& info, bool keepData, unsigned firstLine)
+{
+    unsigned baseAddress = 0;
+    std::string stLine;
+    LineBufferCount lineBufferCount{ stLine };
+    ChunkBuilder chunks(keepData);
+    unsigned iLine = firstLine;
+    uint64_t inputCounted = info.inputSize;
+    info.firstLine = firstLine;
+    PROBE1(image__start, firstLine);
+    try {
+        while (std::getline(input, stLine)) {
+            lineBufferCount.update();
+            info.inputSize += stLine.size() + 1;
+            countProgress(info.inputSize, inputCounted);
+            // Files with Windows line endings are common on other platforms too.
+            if (stLine.ends_with('\r')) {
+                stLine.pop_back();
+            }
+            // If the previous line was an EOF record then EOF wasn't EOF.
+            if (info.foundEof) {
+                throwError("EOF record before end of file");
+            }
+            // Parse the line, and check the checksum, decoding the data into
+            // the image as it goes if it's kept.
+            HexRecord record = parseRecord(std::span(stLine), baseAddress);
+            unsigned char* data = (record.type == typeData) ? chunks.add(record.address, record.dataSize) : nullptr;
+            checkRecord(record, data);
+            PROBE4(record, iLine, unsigned(record.type), record.address, record.dataSize);
+            handleRecord(record, info, baseAddress);
+            ++iLine;
+        }
+        if (!input.eof()) {
+            throwFileError("Error reading file", inFileName);
+        }
+        countProgress(info.inputSize, inputCounted, true);
+    } catch (const std::exception& e) {
+        PROBE2(parse__error, iLine, e.what());
+        // Re-throw the exception with added context
+        std::string str = std::format("{}\nLine {}: {}", e.what(), iLine, makePrintable(stLine));
+        throwError(str.c_str());
+    }
+    chunks.finish(info);
+    info.lastLine = iLine - 1;
+    PROBE3(image__end, info.firstLine, info.lastLine, info.numDataRecords);
+}
+
+// Image - Text of one image in a multi-image hex file
+struct Image
+{
+    std::string_view text;
+    unsigned firstLine;
+};
+
+// splitHexImages - Split the text of a multi-image hex file after each EOF record
+// This only looks for the EOF records; the images are validated when they are parsed.
+static std::vector<Image> splitHexImages(std::string_view text)
+{
+    std::vector<Image> images;
+    size_t start = 0;
+    unsigned firstLine = 1;
+    unsigned iLine = 1;
+    for (size_t pos = 0; pos < text.size(); ++iLine) {
+        size_t eol = text.find('\n', pos);
+        size_t next = (eol == text.npos) ? text.size() : eol + 1;
+        std::string_view line = text.substr(pos, next - pos);
+        if (line.ends_with('\n')) {
+            line.remove_suffix(1);
+        }
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        if (line.size() == 11 && line.starts_with(':') && line.substr(7, 2) == "01") {
+            images.push_back({ text.substr(start, next - start), firstLine });
+            start = next;
+            firstLine = iLine + 1;
+        }
+        pos = next;
+    }
+    if (start < text.size()) {
+        images.push_back({ text.substr(start), firstLine });
+    }
+    return images;
+}
+
+// parseHexImages - Parse the images of a multi-image hex file, each on its own thread
+std::vector<ImageInfo> parseHexImages(std::string_view text, std::exception_ptr& error, bool keepData)
+{
+    std::vector<Image> images = splitHexImages(text);
+    std::vector<ImageInfo> infos(images.size());
+    std::vector<std::exception_ptr> errors(images.size());
+    parallelFor(images.size(), 1, [&](size_t iImage) {
+        try {
+            ReadStream imageInput{ ReadBuffer(images[iImage].text) };
+            processHexFile(imageInput, infos[iImage], keepData, images[iImage].firstLine);
+        } catch (...) {
+            errors[iImage] = std::current_exception();
+        }
+    });
+    for (size_t iImage = 0; iImage < images.size(); ++iImage) {
+        if (errors[iImage]) {
+            error = errors[iImage];
+            infos.resize(iImage);
+            break;
+        }
+    }
+    return infos;
+}
+
+// countChunkOverlaps - Count the chunks that start inside the data of the chunks
+// below them
+static unsigned countChunkOverlaps(const ChunkList& chunks)
+{
+    unsigned count = 0;
+    uint64_t end = 0;
+    for (const Chunk& chunk : std::ranges::reverse_view(chunks)) {
+        count += (chunk.address < end);
+        end = std::max(end, uint64_t(chunk.address) + chunk.size);
+    }
+    return count;
+}
+
+// combineImages - Combine the images of a multi-image hex file into one
+// The overlaps between images are added to the overlaps in each image. The
+// chunks of each image are added as records, so the overlaps between the chunks
+// of the same image, which were counted as records, are taken off again.
+ImageInfo combineImages(const std::vector<ImageInfo>& infos, bool keepData)
+{
+    ImageInfo total;
+    ChunkBuilder chunks(keepData);
+    unsigned numChunkOverlaps = 0;
+    for (const ImageInfo& info : infos) {
+        for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+            if (unsigned char* data = chunks.add(chunk.address, chunk.size)) {
+                std::memcpy(data, chunk.data.data(), chunk.size);
+            }
+        }
+        total.numOverlapping += info.numOverlapping;
+        numChunkOverlaps += countChunkOverlaps(info.chunks);
+        total.inputSize += info.inputSize;
+        for (size_t iType = 0; iType < std::size(total.recordCounts); ++iType) {
+            total.recordCounts[iType] += info.recordCounts[iType];
+        }
+        total.numStartAddresses += info.numStartAddresses;
+        total.hasSegmentRecords = total.hasSegmentRecords || info.hasSegmentRecords;
+        total.startAddress = info.startAddress;
+        total.foundEof = info.foundEof;
+        total.numDataRecords += info.numDataRecords;
+        total.maxDataSize = std::max(total.maxDataSize, info.maxDataSize);
+    }
+    chunks.finish(total);
+    total.numOverlapping -= numChunkOverlaps;
+    return total;
+}
+
+// parseMultiHexFile - Read a file containing several concatenated hex images,
+// and return the combined image
+ImageInfo parseMultiHexFile(std::istream& input, bool keepData)
+{
+    ReadBuffer text = readAll(input);
+    std::exception_ptr error;
+    std::vector<ImageInfo> infos = parseHexImages(text, error, keepData);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return combineImages(infos, keepData);
+}
+
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+// Lazy images (see LazyImage in HexFileParser.h)
+
+LazyImage::LazyImage(const std::string& fileName)
+{
+    fileFd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fileFd < 0) {
+        throwFileError("Failed to open file", fileName);
+    }
+    try {
+        mapText();
+        indexRecords();
+        reserve();
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+LazyImage::~LazyImage()
+{
+    release();
+}
+
+void LazyImage::mapText()
+{
+    struct stat st;
+    if (fstat(fileFd, &st) != 0) {
+        throwFileError("Error reading file", inFileName);
+    }
+    if (st.st_size > 0) {
+        void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fileFd, 0);
+        if (mapping == MAP_FAILED) {
+            throwFileError("Error reading file", inFileName);
+        }
+        textMapping = mapping;
+        text = std::string_view(static_cast<const char*>(textMapping), size_t(st.st_size));
+    }
+    info.inputSize = text.size();
+}
+
+// lineAt - Get the line starting at an offset in the text, without the line ending
+std::string_view LazyImage::lineAt(size_t offset) const
+{
+    std::string_view line = text.substr(offset, text.find('\n', offset) - offset);
+    if (line.ends_with('\r')) {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+
+// indexRecords - Make the index of the data records, and count the records
+void LazyImage::indexRecords()
+{
+    unsigned baseAddress = 0;
+    unsigned iLine = 1;
+    std::string_view line;
+    try {
+        for (size_t pos = 0; pos < text.size(); ++iLine) {
+            line = lineAt(pos);
+            size_t offset = pos;
+            pos = std::min(text.find('\n', pos), text.size()) + 1;
+            if (info.foundEof) {
+                throwError("EOF record before end of file");
+            }
+            // The data is checked and decoded when it's needed, by decodePage.
+            // Records without data are never decoded, so they're checked now.
+            HexRecord record = parseRecord(std::span(line), baseAddress);
+            if (record.type != typeData || record.dataSize == 0) {
+                checkRecord(record, nullptr);
+            } else {
+                records.push_back({ record.address, record.dataSize, offset, iLine });
+            }
+            handleRecord(record, info, baseAddress);
+        }
+    } catch (const std::exception& e) {
+        std::string str = std::format("{}\nLine {}: {}", e.what(), iLine, makePrintable(line));
+        throwError(str.c_str());
+    }
+    info.lastLine = iLine - 1;
+    makeSegments(std::span(records), false, info, [&](std::span<Record>, unsigned, unsigned, std::span<const SegmentRange> segments) {
+        for (const SegmentRange& segment : segments) {
+            segmentList.push_back({ segment.address, segment.size });
+        }
+    });
+}
+
+// reserve - Reserve the address range of the image and start handling page faults in it
+void LazyImage::reserve()
+{
+    if (segmentList.empty()) {
+        return;
+    }
+    pageSize = size_t(sysconf(_SC_PAGESIZE));
+    baseAddress = segmentList.front().address & ~unsigned(pageSize - 1);
+    // Where records overlap, the last segment isn't always the one that ends last.
+    uint64_t end = std::ranges::max(segmentList | std::views::transform([](const Segment& segment) {
+        return uint64_t(segment.address) + segment.size;
+    }));
+    imageSize = (end - baseAddress + pageSize - 1) & ~uint64_t(pageSize - 1);
+    void* mapping = mmap(nullptr, imageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throwError("Failed to reserve memory for the image");
+    }
+    base = static_cast<unsigned char*>(mapping);
+    // Faults in the kernel (e.g. write() from the image) need privileges;
+    // without them, only faults in user code are handled.
+    uffd = int(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+#ifdef UFFD_USER_MODE_ONLY
+    if (uffd < 0 && errno == EPERM) {
+        uffd = int(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY));
+    }
+#endif
+    if (uffd < 0) {
+        throwError("userfaultfd is not available (see vm.unprivileged_userfaultfd)");
+    }
+    uffdio_api api = {};
+    api.api = UFFD_API;
+    uffdio_register registration = {};
+    registration.range.start = reinterpret_cast<uintptr_t>(base);
+    registration.range.len = imageSize;
+    registration.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(uffd, UFFDIO_API, &api) != 0 || ioctl(uffd, UFFDIO_REGISTER, &registration) != 0) {
+        throwError("Failed to register the image with userfaultfd");
+    }
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd < 0) {
+        throwError("Failed to create eventfd");
+    }
+    handler = std::jthread([this] { handleFaults(); });
+}
+
+// handleFaults - Decode each page of the image when it's first accessed
+// This must never touch the image itself.
+void LazyImage::handleFaults()
+{
+    auto page = std::make_unique<unsigned char[]>(pageSize);
+    pollfd fds[2] = { { uffd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        uffd_msg msg;
+        if (::read(uffd, &msg, sizeof(msg)) != ssize_t(sizeof(msg)) || msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        uintptr_t pageStart = uintptr_t(msg.arg.pagefault.address) & ~uintptr_t(pageSize - 1);
+        decodePage(baseAddress + (pageStart - reinterpret_cast<uintptr_t>(base)), page.get());
+        uffdio_copy copy = {};
+        copy.dst = pageStart;
+        copy.src = reinterpret_cast<uintptr_t>(page.get());
+        copy.len = pageSize;
+        // Counted first, because the faulting thread can run as soon as the page is filled
+        ++pagesDecoded;
+        if (ioctl(uffd, UFFDIO_COPY, &copy) != 0) {
+            --pagesDecoded;
+            if (errno != EEXIST) {
+                setError("Failed to fill a page of the image");
+            }
+        }
+    }
+}
+
+// decodePage - Decode the data for one page from the records that overlap it
+// Where records overlap, the one later in the file wins, as in the eager parser.
+void LazyImage::decodePage(uint64_t start, unsigned char* page)
+{
+    std::fill_n(page, pageSize, 0);
+    uint64_t end = start + pageSize;
+    // Records are at most 255 bytes, so one that overlaps the page can't start
+    // more than 255 bytes before it.
+    pageRecords.clear();
+    auto iter = std::ranges::lower_bound(records, start - std::min<uint64_t>(start, 255), {}, &Record::address);
+    for (; iter != records.end() && iter->address < end; ++iter) {
+        if (uint64_t(iter->address) + iter->size > start) {
+            pageRecords.push_back(&*iter);
+        }
+    }
+    std::ranges::sort(pageRecords, {}, &Record::offset);
+    unsigned char data[255];
+    for (const Record* record : pageRecords) {
+        std::string_view line = lineAt(record->offset);
+        try {
+            checkRecord(parseRecord(std::span(line), 0), data);
+        } catch (const std::exception& e) {
+            setError(std::format("{}\nLine {}: {}", e.what(), record->iLine, makePrintable(line)));
+            continue;
+        }
+        uint64_t first = std::max<uint64_t>(start, record->address);
+        uint64_t last = std::min<uint64_t>(end, uint64_t(record->address) + record->size);
+        std::memcpy(page + (first - start), data + (first - record->address), size_t(last - first));
+    }
+}
+
+void LazyImage::setError(std::string message)
+{
+    std::lock_guard lock(errorMutex);
+    if (!hasError) {
+        firstError = std::move(message);
+        hasError = true;
+    }
+}
+
+void LazyImage::release()
+{
+    if (handler.joinable()) {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(stopFd, &one, sizeof(one));
+        handler.join();
+    }
+    for (int fd : { stopFd, uffd, fileFd }) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    if (base) {
+        munmap(base, imageSize);
+    }
+    if (textMapping) {
+        munmap(textMapping, text.size());
+    }
+}
+#endif
+
+// getExtension - Get the extension of a file name, in lower case
+// (this is called for every file, so it doesn't use std::filesystem::path)
+std::string getExtension(std::string_view fileName)
+{
+    std::string_view name = fileName.substr(fileName.find_last_of("/\\") + 1);
+    size_t dot = name.rfind('.');
+    if (dot == name.npos || dot == 0 || name == "..") {
+        return {};
+    }
+    std::string ext(name.substr(dot));
+    std::ranges::transform(ext, ext.begin(), [](unsigned char ch) { return char(std::tolower(ch)); });
+    return ext;
+}
+
+bool isUf2FileName(const std::string& fileName)
+{
+    return getExtension(fileName) == ".uf2";
+}
+
+// isUf2Data - Check whether data in memory looks like a UF2 file
+bool isUf2Data(std::span<const char> data)
+{
+    uint32_t magic = 0;
+    if (data.size() >= sizeof(magic)) {
+        std::memcpy(&magic, data.data(), sizeof(magic));
+    }
+    return magic == uf2MagicStart0;
+}
+
+void processUf2File(std::istream& input, ImageInfo& info, bool keepData)
+{
+    info.isUf2 = true;
+    ChunkBuilder chunks(keepData);
+    Uf2Block block;
+    unsigned iBlock = 0;
+    // A UF2 file can be several UF2 files concatenated (e.g. a bootloader and
+    // an application, or images for several families), each a sequence of
+    // blocks numbered from 0. The file is complete if every sequence is.
+    uint32_t sequenceBlocks = 0; // numBlocks of the current sequence
+    bool earlierComplete = true; // whether the sequences before it were complete
+    uint64_t inputCounted = info.inputSize;
+    try {
+        while (input.read(reinterpret_cast<char*>(&block), sizeof(block))) {
+            if (block.magicStart0 != uf2MagicStart0 || block.magicStart1 != uf2MagicStart1
+                || block.magicEnd != uf2MagicEnd || block.payloadSize > sizeof(block.data))
+            {
+                throwError("Invalid data in UF2 file");
+            }
+            if (iBlock == 0 || block.blockNo == 0) {
+                earlierComplete = earlierComplete && (iBlock == 0 || info.foundEof);
+                sequenceBlocks = block.numBlocks;
+            } else if (block.numBlocks != sequenceBlocks) {
+                throwError("Number of UF2 blocks changed within a sequence");
+            }
+            if (block.flags & uf2FlagFamilyIdPresent) {
+                if (info.numFamilyIds == 0 || block.familyId != info.familyId) {
+                    ++info.numFamilyIds;
+                }
+                info.familyId = block.familyId;
+            }
+            info.inputSize += sizeof(block);
+            countProgress(info.inputSize, inputCounted);
+            // Blocks that aren't for the main flash are skipped, as the spec says.
+            if (!(block.flags & uf2FlagNotMainFlash)) {
+                ++info.recordCounts[typeData];
+                if (unsigned char* data = chunks.add(block.targetAddr, block.payloadSize)) {
+                    std::memcpy(data, block.data, block.payloadSize);
+                }
+                ++info.numDataRecords;
+                info.maxDataSize = std::max(info.maxDataSize, block.payloadSize);
+            }
+            info.foundEof = earlierComplete && (block.blockNo + 1 == block.numBlocks);
+            ++iBlock;
+        }
+        if (input.gcount() != 0) {
+            throwError("Incomplete UF2 block at end of file");
+        }
+        if (!input.eof()) {
+            throwFileError("Error reading file", inFileName);
+        }
+        countProgress(info.inputSize, inputCounted, true);
+    } catch (const std::exception& e) {
+        // Re-throw the exception with added context
+        std::string str = std::format("{}\nBlock {}", e.what(), iBlock);
+        throwError(str.c_str());
+    }
+    chunks.finish(info);
+}
@@ -0,0 +1,525 @@
+/*
+HexFileParser - Parser for Intel HEX and UF2 files
+
+This is the parser used by HexFileInfo, the C library (lib/) and the Python
+module (python/).
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef HEXFILEPARSER_H
+#define HEXFILEPARSER_H
+
+#include <iostream>
+#include <sstream>
+#include <list>
+#include <memory>
+#include <vector>
+#include <array>
+#include <string>
+#include <string_view>
+#include <span>
+#include <algorithm>
+#ifdef HEXFILEINFO_USE_FMT
+// For standard libraries without <format> (see CMakeLists.txt)
+#include <fmt/format.h>
+namespace std { using fmt::format; }
+#else
+#include <format>
+#endif
+#include <thread>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <atomic>
+#if defined(__linux__) && __has_include(<linux/userfaultfd.h>)
+#define HEXFILEINFO_HAVE_USERFAULTFD
+#endif
+
+// Static tracepoints (USDT) for SystemTap and bpftrace, e.g.
+//   bpftrace -e 'usdt:./HexFileInfo:hexfileinfo:overlap { printf("%x\n", arg0); }'
+// Each probe compiles to a single NOP, and its arguments are only used when a
+// tracer is attached. Without <sys/sdt.h> the probes are left out.
+#if __has_include(<sys/sdt.h>) && !defined(HEXFILEINFO_NO_PROBES)
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(hexfileinfo, name)
+#define PROBE1(name, a1) DTRACE_PROBE1(hexfileinfo, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(hexfileinfo, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(hexfileinfo, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(hexfileinfo, name, a1, a2, a3, a4)
+#else
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a1) ((void)0)
+#define PROBE2(name, a1, a2) ((void)0)
+#define PROBE3(name, a1, a2, a3) ((void)0)
+#define PROBE4(name, a1, a2, a3, a4) ((void)0)
+#endif
+
+// Errors
+// Errors are thrown as std::runtime_error. inFileName is the name of the file
+// the current thread is reading, for the error messages.
+
+extern thread_local std::string inFileName;
+
+[[noreturn]] void throwError(const char* message);
+[[noreturn]] void throwFileError(const char* message, const std::string& fileName);
+[[noreturn]] void throwFormatError();
+
+std::string makePrintable(std::string_view str);
+
+// hexDigitValues - The value of each hex digit character, or -1 for other characters
+constexpr std::array<signed char, 256> hexDigitValues = [] {
+    std::array<signed char, 256> values;
+    values.fill(-1);
+    for (int i = 0; i < 10; ++i) {
+        values['0' + i] = static_cast<signed char>(i);
+    }
+    for (int i = 0; i < 6; ++i) {
+        values['a' + i] = values['A' + i] = static_cast<signed char>(10 + i);
+    }
+    return values;
+}();
+
+inline unsigned fromHex(std::span<const char> hex)
+{
+    unsigned n = 0;
+    if (hex.size() > 2 * sizeof(n)) throwError("Number too large");
+    for (char digit : hex) {
+        int value = hexDigitValues[static_cast<unsigned char>(digit)];
+        if (value < 0) throwFormatError();
+        n = n * 16 + unsigned(value);
+    }
+    return n;
+}
+
+// Memory accounting
+// The main data structures use CountingAllocator, which counts the bytes in use
+// and the high-water mark in each category for the file that the current
+// thread is processing (see --stats). Threads helping with a file share its counts.
+
+enum memoryCategory_t {
+    memChunks,
+    memLineBuffer,
+    memReadBuffer,
+    memOutputBuffer,
+    numMemoryCategories
+};
+
+const char* const memoryCategoryNames[] = { "data segments", "line buffer", "read buffers", "output buffers" };
+
+struct MemoryUsage
+{
+    std::atomic<int64_t> current[numMemoryCategories] = {};
+    std::atomic<int64_t> peak[numMemoryCategories] = {};
+};
+
+extern thread_local constinit MemoryUsage* threadMemoryUsage;
+
+inline void countMemory(memoryCategory_t category, int64_t bytes)
+{
+    MemoryUsage* usage = threadMemoryUsage;
+    if (usage) {
+        int64_t current = usage->current[category].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        int64_t peak = usage->peak[category].load(std::memory_order_relaxed);
+        while (current > peak && !usage->peak[category].compare_exchange_weak(peak, current, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+template<typename T, memoryCategory_t category>
+struct CountingAllocator
+{
+    using value_type = T;
+    template<typename U>
+    struct rebind
+    {
+        using other = CountingAllocator<U, category>;
+    };
+
+    CountingAllocator() = default;
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U, category>&) {}
+
+    T* allocate(size_t n)
+    {
+        T* p = std::allocator<T>().allocate(n);
+        countMemory(category, int64_t(n * sizeof(T)));
+        return p;
+    }
+    void deallocate(T* p, size_t n)
+    {
+        countMemory(category, -int64_t(n * sizeof(T)));
+        std::allocator<T>().deallocate(p, n);
+    }
+    friend bool operator==(const CountingAllocator&, const CountingAllocator&)
+    {
+        return true;
+    }
+};
+
+// LineBufferCount - Counts the memory of a line buffer
+// The line buffer is a plain std::string because std::getline has a much
+// faster implementation for it than for other allocators.
+struct LineBufferCount
+{
+    const std::string& line;
+    size_t counted = 0;
+
+    void update()
+    {
+        if (line.capacity() != counted) {
+            countMemory(memLineBuffer, int64_t(line.capacity()) - int64_t(counted));
+            counted = line.capacity();
+        }
+    }
+
+    ~LineBufferCount()
+    {
+        countMemory(memLineBuffer, -int64_t(counted));
+    }
+};
+using ReadBuffer = std::basic_string<char, std::char_traits<char>, CountingAllocator<char, memReadBuffer>>;
+using ReadStream = std::basic_istringstream<char, std::char_traits<char>, CountingAllocator<char, memReadBuffer>>;
+
+ReadBuffer readAll(std::istream& input);
+
+// Progress counting
+// With --progress, each worker thread has a WorkerProgress for the file it's
+// working on. The parsers add the bytes they've read in blocks of
+// progressBlockSize rather than per record, so the atomics are rarely touched.
+
+const uint64_t progressBlockSize = 0x10000;
+
+struct WorkerProgress
+{
+    std::atomic<const char*> fileName = nullptr;
+    std::atomic<uint64_t> fileSize = 0;
+    std::atomic<uint64_t> bytesDone = 0;
+};
+
+extern std::atomic<uint64_t> progressBytesDone;
+extern thread_local constinit WorkerProgress* threadProgress;
+
+// countProgress - Add the input read since the last call to the progress counts,
+// if at least a block has been read or if final is true
+inline void countProgress(uint64_t inputSize, uint64_t& inputCounted, bool final = false)
+{
+    uint64_t bytes = inputSize - inputCounted;
+    if (threadProgress && (bytes >= progressBlockSize || (final && bytes > 0))) {
+        threadProgress->bytesDone.fetch_add(bytes, std::memory_order_relaxed);
+        progressBytesDone.fetch_add(bytes, std::memory_order_relaxed);
+        inputCounted = inputSize;
+    }
+}
+
+// HelperThreads - Takes helper threads for parallelFor from the budget shared by
+// all threads, and gives them back when it's destroyed
+// The budget starts at one less than the number of CPU cores, so a parallelFor
+// in each of several threads (e.g. the CLI's --jobs workers) can't start more
+// threads than there are cores between them.
+class HelperThreads
+{
+public:
+    explicit HelperThreads(size_t wanted);
+    ~HelperThreads();
+
+    HelperThreads(const HelperThreads&) = delete;
+    HelperThreads& operator=(const HelperThreads&) = delete;
+
+    unsigned count() const
+    {
+        return numTaken;
+    }
+
+    // setLimit - Set the number of helper threads that may run at once
+    // This is only called before any are taken.
+    static void setLimit(unsigned limit);
+
+private:
+    unsigned numTaken = 0;
+};
+
+// parallelFor - Call func(i) for each i in [0, count), split between the calling
+// thread and as many helper threads as the budget allows
+// Each thread gets at least minPerThread items so small jobs don't pay for threads.
+void parallelFor(size_t count, size_t minPerThread, const auto& func)
+{
+    size_t maxThreads = count / std::max<size_t>(minPerThread, 1);
+    HelperThreads helpers(maxThreads > 1 ? maxThreads - 1 : 0);
+    size_t numThreads = helpers.count() + 1;
+    auto runPart = [&func, count, numThreads](size_t iThread) {
+        size_t end = count * (iThread + 1) / numThreads;
+        for (size_t i = count * iThread / numThreads; i < end; ++i) {
+            func(i);
+        }
+    };
+    std::vector<std::jthread> threads;
+    for (size_t iThread = 1; iThread < numThreads; ++iThread) {
+        threads.emplace_back([&runPart, iThread, memoryUsage = threadMemoryUsage, progress = threadProgress, fileName = inFileName] {
+            threadMemoryUsage = memoryUsage;
+            threadProgress = progress;
+            inFileName = fileName;
+            runPart(iThread);
+        });
+    }
+    runPart(0);
+}
+
+using ChunkData = std::vector<unsigned char, CountingAllocator<unsigned char, memChunks>>;
+
+// Chunk - Represents a chunk of data from several contiguous or overlapping data records
+// The data is empty if the parser wasn't asked to keep it.
+struct Chunk
+{
+    unsigned address;
+    unsigned size;
+    ChunkData data;
+};
+
+// ImageInfo - Everything collected from an input file, for the summary and for output
+using ChunkList = std::list<Chunk, CountingAllocator<Chunk, memChunks>>;
+
+struct ImageInfo
+{
+    ChunkList chunks; // in descending order of address
+    unsigned numOverlapping = 0;
+    bool foundEof = false;
+    bool hasSegmentRecords = false;
+    unsigned firstLine = 1;
+    unsigned lastLine = 0;
+    unsigned numStartAddresses = 0;
+    unsigned startAddress = 0;
+    unsigned numDataRecords = 0;
+    unsigned maxDataSize = 0;
+    uint64_t inputSize = 0;
+    unsigned recordCounts[6] = {}; // by record type
+    bool isUf2 = false;
+    unsigned numFamilyIds = 0;
+    unsigned familyId = 0;
+};
+
+enum recordType_t {
+    typeNone = -1,
+    typeData = 0,
+    typeEof = 1,
+    typeEsa = 2,
+    typeSsa = 3,
+    typeEla = 4,
+    typeSla = 5
+};
+
+const char* const recordTypeNames[] = { "data", "eof", "esa", "ssa", "ela", "sla" };
+
+// The parsers only keep the data of the records if keepData is true; otherwise
+// the chunks just give the layout of the image, which is enough for a summary.
+// numOverlapping counts the records that start inside the data of records at
+// lower addresses, or at the same address earlier in the file. Overlapping
+// records are merged into one chunk, where the later record in the file wins.
+
+void processHexFile(std::istream& input, ImageInfo& info, bool keepData = true, unsigned firstLine = 1);
+
+// Multi-image hex files
+// A file containing several concatenated hex images is split after each EOF
+// record, and the images are parsed in parallel. parseHexImages returns the
+// images before the first one with an error, and the error.
+
+std::vector<ImageInfo> parseHexImages(std::string_view text, std::exception_ptr& error, bool keepData = true);
+ImageInfo combineImages(const std::vector<ImageInfo>& infos, bool keepData = true);
+ImageInfo parseMultiHexFile(std::istream& input, bool keepData = true);
+
+// MemoryStreamBuf - Input stream buffer that reads from memory without copying it
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(const char* data, size_t size)
+    {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+// FdStreamBuf - Input stream buffer that reads from a file descriptor into a
+// buffer that the caller owns, so it can be reused
+class FdStreamBuf : public std::streambuf
+{
+public:
+    FdStreamBuf(int fd, std::span<char> buffer) : fd(fd), buffer(buffer) {}
+
+    // peek - Get the data at the start of the input, without consuming it
+    std::span<const char> peek()
+    {
+        underflow();
+        return { gptr(), egptr() };
+    }
+
+protected:
+    int_type underflow() override;
+
+private:
+    int fd;
+    std::span<char> buffer;
+};
+
+// FileDescriptor - Owns a file opened for reading
+class FileDescriptor
+{
+public:
+    explicit FileDescriptor(const char* path);
+    ~FileDescriptor();
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const
+    {
+        return fd;
+    }
+
+private:
+    int fd;
+};
+
+// UF2 file format is defined here: https://github.com/microsoft/uf2
+
+struct Uf2Block
+{
+    uint32_t magicStart0;
+    uint32_t magicStart1;
+    uint32_t flags;
+    uint32_t targetAddr;
+    uint32_t payloadSize;
+    uint32_t blockNo;
+    uint32_t numBlocks;
+    uint32_t familyId; // or file size, depending on flags
+    unsigned char data[476];
+    uint32_t magicEnd;
+};
+static_assert(sizeof(Uf2Block) == 512);
+static_assert(std::endian::native == std::endian::little, "UF2 blocks are little-endian");
+
+const uint32_t uf2MagicStart0 = 0x0A324655;
+const uint32_t uf2MagicStart1 = 0x9E5D5157;
+const uint32_t uf2MagicEnd = 0x0AB16F30;
+const uint32_t uf2FlagNotMainFlash = 0x00000001;
+const uint32_t uf2FlagFamilyIdPresent = 0x00002000;
+const unsigned uf2PayloadSize = 256;
+
+std::string getExtension(std::string_view fileName);
+bool isUf2FileName(const std::string& fileName);
+bool isUf2Data(std::span<const char> data);
+void processUf2File(std::istream& input, ImageInfo& info, bool keepData = true);
+
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+// Lazy images
+// A LazyImage maps a hex file and only decodes its data a page at a time, when
+// each page is first accessed, for huge images where only a few regions are
+// used. The image's address range is reserved and registered with userfaultfd,
+// and a handler thread decodes each page when it's first touched, using an index
+// of the data records by address. Opening the image only checks the record
+// headers; the data and checksums of the records in a page are checked when
+// it's decoded, and the first error found is kept. Gaps read as 0.
+
+class LazyImage
+{
+public:
+    // Segment - A range of addresses covered by data records
+    struct Segment
+    {
+        unsigned address;
+        unsigned size;
+    };
+
+    explicit LazyImage(const std::string& fileName);
+    ~LazyImage();
+
+    LazyImage(const LazyImage&) = delete;
+    LazyImage& operator=(const LazyImage&) = delete;
+
+    // pointer - Get a pointer to the data at an address in the image
+    const unsigned char* pointer(unsigned address) const
+    {
+        return base + (address - baseAddress);
+    }
+
+    const std::vector<Segment>& segments() const
+    {
+        return segmentList;
+    }
+
+    // summary - Get the image info, without the chunks
+    const ImageInfo& summary() const
+    {
+        return info;
+    }
+
+    size_t numPagesDecoded() const
+    {
+        return pagesDecoded.load();
+    }
+
+    // error - Get the first error found while decoding pages, or null
+    const char* error() const
+    {
+        return hasError.load() ? firstError.c_str() : nullptr;
+    }
+
+private:
+    struct Record
+    {
+        unsigned address;
+        unsigned size;
+        size_t offset; // of the line in the text
+        unsigned iLine;
+    };
+
+    void mapText();
+    std::string_view lineAt(size_t offset) const;
+    void indexRecords();
+    void reserve();
+    void handleFaults();
+    void decodePage(uint64_t start, unsigned char* page);
+    void setError(std::string message);
+    void release();
+
+    int fileFd = -1;
+    void* textMapping = nullptr; // null if the file is empty
+    std::string_view text;
+    std::vector<Record> records; // in order of address
+    std::vector<const Record*> pageRecords; // used by decodePage
+    std::vector<Segment> segmentList;
+    ImageInfo info;
+    unsigned baseAddress = 0; // of the first page
+    uint64_t imageSize = 0;
+    size_t pageSize = 0;
+    unsigned char* base = nullptr;
+    int uffd = -1;
+    int stopFd = -1;
+    std::atomic<size_t> pagesDecoded = 0;
+    std::mutex errorMutex;
+    std::atomic<bool> hasError = false;
+    std::string firstError;
+    std::jthread handler;
+};
+#endif
+
+#endif
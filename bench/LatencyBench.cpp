@@ -0,0 +1,112 @@
+/*
+LatencyBench - Measure the end-to-end latency of running a command, e.g.
+HexFileInfo on a small file, including process startup
+
+Usage: LatencyBench [--runs N] [--budget MS] PROGRAM [ARGS...]
+
+The command is run N times (default 500) after a few warm-up runs, with its
+output discarded, and the latency percentiles are shown. With --budget, the
+exit status is 1 if the median latency is over MS milliseconds.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// runOnce - Run the command with its output discarded, and return the elapsed
+// time in milliseconds, or a negative value if it failed
+static double runOnce(char** args, const posix_spawn_file_actions_t& actions)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    pid_t pid;
+    if (posix_spawn(&pid, args[0], &actions, nullptr, args, environ) != 0) {
+        return -1;
+    }
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned numWarmUpRuns = 10;
+    unsigned numRuns = 500;
+    double budget = 0;
+    int iArg = 1;
+    for (; iArg + 1 < argc && std::string_view(argv[iArg]).starts_with("--"); iArg += 2) {
+        std::string_view arg = argv[iArg];
+        if (arg == "--runs") {
+            numRuns = std::max(1, std::atoi(argv[iArg + 1]));
+        } else if (arg == "--budget") {
+            budget = std::atof(argv[iArg + 1]);
+        } else {
+            break;
+        }
+    }
+    if (iArg >= argc || std::string_view(argv[iArg]).starts_with("--")) {
+        std::cerr << "Usage: LatencyBench [--runs N] [--budget MS] PROGRAM [ARGS...]\n";
+        return 2;
+    }
+    char** args = argv + iArg;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    std::vector<double> times;
+    for (unsigned iRun = 0; iRun < numWarmUpRuns + numRuns; ++iRun) {
+        double ms = runOnce(args, actions);
+        if (ms < 0) {
+            std::cerr << "LatencyBench: Error: the command failed: " << args[0] << '\n';
+            return 2;
+        }
+        if (iRun >= numWarmUpRuns) {
+            times.push_back(ms);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    std::ranges::sort(times);
+    auto percentile = [&times](double p) { return times[std::min(times.size() - 1, size_t(p / 100 * times.size()))]; };
+    std::cout << std::fixed << std::setprecision(3);
+    for (int i = iArg; i < argc; ++i) {
+        std::cout << argv[i] << (i + 1 < argc ? " " : "\n");
+    }
+    std::cout << numRuns << " runs, latency min " << times.front() << " ms, p50 " << percentile(50)
+        << " ms, p90 " << percentile(90) << " ms, p99 " << percentile(99) << " ms\n";
+    if (budget > 0) {
+        bool ok = percentile(50) <= budget;
+        std::cout << "Budget " << budget << " ms: " << (ok ? "met" : "exceeded") << '\n';
+        return ok ? 0 : 1;
+    }
+    return 0;
+}
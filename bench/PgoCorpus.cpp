@@ -0,0 +1,231 @@
+/*
+PgoCorpus - Write the synthetic set of HEX and UF2 files for PGO training
+
+Usage: PgoCorpus DIR
+
+The files (about 26 MB) cover what the parser sees in real use, in roughly
+real proportions: images of a few segments in ascending order with 16- and
+32-byte records and extended linear addresses, with LF and CRLF line endings,
+plus some with segment addresses, records in descending order, overlapping
+records, several images for --multi (named multi-*.hex), UF2 files, and a few
+files with errors. The same files are written every time.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Only the record types and UF2 definitions are used, so the parser isn't linked.
+#include "../HexFileParser.h"
+#include <fstream>
+#include <filesystem>
+#include <random>
+
+static std::minstd_rand randomBytes(1);
+
+// Record - A record of a hex file, before it's formatted
+struct Record
+{
+    recordType_t type;
+    unsigned address; // the low 16 bits are in the record
+    std::vector<unsigned char> data;
+};
+
+// formatRecord - Format a record with its checksum
+static std::string formatRecord(const Record& record, std::string_view lineEnd)
+{
+    std::string line = std::format(":{:02X}{:04X}{:02X}", record.data.size(), record.address & 0xFFFF, int(record.type));
+    unsigned char checksum = static_cast<unsigned char>(record.data.size() + (record.address >> 8) + record.address + record.type);
+    for (unsigned char byte : record.data) {
+        line += std::format("{:02X}", byte);
+        checksum += byte;
+    }
+    return line + std::format("{:02X}", static_cast<unsigned char>(-checksum)) + std::string(lineEnd);
+}
+
+static std::vector<unsigned char> randomData(unsigned size)
+{
+    std::vector<unsigned char> data(size);
+    for (unsigned char& byte : data) {
+        byte = static_cast<unsigned char>(randomBytes() >> 8);
+    }
+    return data;
+}
+
+// makeDataRecords - Make the data records for segments of the given size,
+// with an extended linear address record before each 64K
+static std::vector<Record> makeDataRecords(unsigned address, unsigned numSegments, unsigned segmentSize, unsigned recordSize)
+{
+    std::vector<Record> records;
+    for (unsigned iSegment = 0; iSegment < numSegments; ++iSegment) {
+        unsigned start = address + iSegment * 2 * segmentSize;
+        for (unsigned offset = 0; offset < segmentSize; offset += recordSize) {
+            unsigned recordAddress = start + offset;
+            if (offset == 0 || recordAddress % 0x10000 == 0) {
+                records.push_back({ typeEla, 0, { static_cast<unsigned char>(recordAddress >> 24), static_cast<unsigned char>(recordAddress >> 16) } });
+            }
+            records.push_back({ typeData, recordAddress, randomData(std::min(recordSize, segmentSize - offset)) });
+        }
+    }
+    return records;
+}
+
+// imageText - Format the records of an image, with a start address (a linear
+// one unless it's zero) and an EOF record
+static std::string imageText(const std::vector<Record>& records, unsigned startAddress, std::string_view lineEnd)
+{
+    std::string text;
+    for (const Record& record : records) {
+        text += formatRecord(record, lineEnd);
+    }
+    if (startAddress != 0) {
+        std::vector<unsigned char> start = { static_cast<unsigned char>(startAddress >> 24), static_cast<unsigned char>(startAddress >> 16),
+            static_cast<unsigned char>(startAddress >> 8), static_cast<unsigned char>(startAddress) };
+        text += formatRecord({ typeSla, 0, start }, lineEnd);
+    }
+    return text + formatRecord({ typeEof, 0, {} }, lineEnd);
+}
+
+// descendingOrder - Reverse the order of the data records, keeping each after its
+// extended linear address record
+static std::vector<Record> descendingOrder(const std::vector<Record>& records)
+{
+    std::vector<Record> reversed;
+    for (auto iter = records.rbegin(); iter != records.rend(); ++iter) {
+        if (iter->type == typeData) {
+            reversed.push_back({ typeEla, 0, { static_cast<unsigned char>(iter->address >> 24), static_cast<unsigned char>(iter->address >> 16) } });
+            reversed.push_back(*iter);
+        }
+    }
+    return reversed;
+}
+
+// segmentAddressRecords - Make records for the 8086 segmented address space
+static std::vector<Record> segmentAddressRecords(unsigned size)
+{
+    std::vector<Record> records;
+    for (unsigned address = 0; address < size; address += 16) {
+        if (address % 0x10000 == 0) {
+            unsigned segment = address >> 4;
+            records.push_back({ typeEsa, 0, { static_cast<unsigned char>(segment >> 8), static_cast<unsigned char>(segment) } });
+        }
+        records.push_back({ typeData, address, randomData(16) });
+    }
+    return records;
+}
+
+static void writeFile(const std::filesystem::path& fileName, std::string_view text)
+{
+    std::ofstream file(fileName, std::ios::binary);
+    file.write(text.data(), std::streamsize(text.size()));
+    file.close();
+    if (file.fail()) {
+        throw std::runtime_error(std::format("Error writing file {}", fileName.string()));
+    }
+}
+
+// uf2Text - Make a UF2 file of contiguous data
+static std::string uf2Text(unsigned address, unsigned size)
+{
+    std::string text;
+    unsigned numBlocks = (size + uf2PayloadSize - 1) / uf2PayloadSize;
+    for (unsigned iBlock = 0; iBlock < numBlocks; ++iBlock) {
+        Uf2Block block = {};
+        block.magicStart0 = uf2MagicStart0;
+        block.magicStart1 = uf2MagicStart1;
+        block.flags = uf2FlagFamilyIdPresent;
+        block.targetAddr = address + iBlock * uf2PayloadSize;
+        block.payloadSize = uf2PayloadSize;
+        block.blockNo = iBlock;
+        block.numBlocks = numBlocks;
+        block.familyId = 0xE48BFF56;
+        std::vector<unsigned char> data = randomData(uf2PayloadSize);
+        std::copy(data.begin(), data.end(), block.data);
+        block.magicEnd = uf2MagicEnd;
+        text.append(reinterpret_cast<const char*>(&block), sizeof(block));
+    }
+    return text;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cerr << "Usage: PgoCorpus DIR\n";
+        return 2;
+    }
+    try {
+        std::filesystem::path dir = argv[1];
+        std::filesystem::create_directories(dir);
+        // Typical images: a few segments in ascending order
+        for (unsigned iFile = 0; iFile < 24; ++iFile) {
+            unsigned segmentSize = 0x4000 << (iFile % 5);
+            unsigned recordSize = (iFile % 3 == 0) ? 32 : 16;
+            std::string_view lineEnd = (iFile % 4 == 3) ? "\r\n" : "\n";
+            auto records = makeDataRecords(0x08000000 + iFile * 0x100000, 1 + iFile % 4, segmentSize, recordSize);
+            writeFile(dir / std::format("image-{}.hex", iFile + 1), imageText(records, 0x08000101, lineEnd));
+        }
+        // Records in descending order of address
+        for (unsigned iFile = 0; iFile < 2; ++iFile) {
+            auto records = descendingOrder(makeDataRecords(0x10000000, 2, 0x20000, 16));
+            writeFile(dir / std::format("descending-{}.hex", iFile + 1), imageText(records, 0x10000000, "\n"));
+        }
+        // Overlapping records, as from a patch appended to an image
+        for (unsigned iFile = 0; iFile < 2; ++iFile) {
+            auto records = makeDataRecords(0x00000000, 1, 0x40000, 16);
+            auto patch = makeDataRecords(0x00001008, 1, 0x2000, 16);
+            records.insert(records.end(), patch.begin(), patch.end());
+            writeFile(dir / std::format("overlapping-{}.hex", iFile + 1), imageText(records, 0x00000101, "\n"));
+        }
+        // Segment addresses, with a CS:IP start address
+        for (unsigned iFile = 0; iFile < 2; ++iFile) {
+            auto records = segmentAddressRecords(0x30000);
+            records.push_back({ typeSsa, 0, { 0xF0, 0x00, 0xFF, 0xF0 } });
+            writeFile(dir / std::format("segmented-{}.hex", iFile + 1), imageText(records, 0, "\r\n"));
+        }
+        // Several images in one file, for --multi
+        for (unsigned iFile = 0; iFile < 2; ++iFile) {
+            std::string text;
+            for (unsigned iImage = 0; iImage < 4; ++iImage) {
+                text += imageText(makeDataRecords(0x08000000 + iImage * 0x40000, 1, 0x20000, 16), 0x08000000, "\n");
+            }
+            writeFile(dir / std::format("multi-{}.hex", iFile + 1), text);
+        }
+        // UF2 files
+        for (unsigned iFile = 0; iFile < 4; ++iFile) {
+            writeFile(dir / std::format("image-{}.uf2", iFile + 1), uf2Text(0x10000000, 0x40000 << (iFile % 2)));
+        }
+        // Errors, near the end so that most of the file is parsed
+        for (unsigned iFile = 0; iFile < 3; ++iFile) {
+            std::string text = imageText(makeDataRecords(0x08000000, 1, 0x10000, 16), 0x08000000, "\n");
+            size_t pos = text.size() - 200;
+            if (iFile == 0) {
+                text[pos] = 'G'; // invalid character
+            } else if (iFile == 1) {
+                text[pos] = (text[pos] == '0') ? '1' : '0'; // incorrect checksum
+            } else {
+                text += ":00000001FF\n"; // EOF record before end of file
+            }
+            writeFile(dir / std::format("error-{}.hex", iFile + 1), text);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << std::format("PgoCorpus: Error: {}\n", e.what());
+        return 2;
+    }
+    return 0;
+}
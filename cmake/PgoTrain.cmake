@@ -0,0 +1,56 @@
+# PGO training: run an instrumented HexFileInfo over the synthetic corpus
+# written by CORPUS_PROGRAM and the training files
+#
+# Variables: PROGRAM, CORPUS_PROGRAM, TRAINING (list of files and directories),
+# PGO_DIR, LLVM_PROFDATA (Clang only)
+
+file(REMOVE_RECURSE "${PGO_DIR}")
+file(MAKE_DIRECTORY "${PGO_DIR}")
+set(outDir "${PGO_DIR}/output")
+file(MAKE_DIRECTORY "${outDir}")
+
+set(corpusDir "${PGO_DIR}/corpus")
+execute_process(COMMAND "${CORPUS_PROGRAM}" "${corpusDir}" RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "Writing the PGO training corpus failed")
+endif()
+
+set(inputs)
+foreach(path IN LISTS corpusDir TRAINING)
+    if(IS_DIRECTORY "${path}")
+        file(GLOB_RECURSE found "${path}/*.hex" "${path}/*.ihex" "${path}/*.uf2")
+        list(APPEND inputs ${found})
+    else()
+        list(APPEND inputs "${path}")
+    endif()
+endforeach()
+if(NOT inputs)
+    message(FATAL_ERROR "No PGO training files in: ${TRAINING}")
+endif()
+
+# Invalid files are expected in a training set, so failures are ignored.
+foreach(input IN LISTS inputs)
+    get_filename_component(name "${input}" NAME)
+    if(name MATCHES "^multi-")
+        execute_process(COMMAND "${PROGRAM}" --multi "${input}" OUTPUT_QUIET ERROR_QUIET)
+        continue()
+    endif()
+    execute_process(COMMAND "${PROGRAM}" "${input}" OUTPUT_QUIET ERROR_QUIET)
+    execute_process(COMMAND "${PROGRAM}" --entropy --uf2 "${outDir}/train.uf2" "${input}"
+        OUTPUT_QUIET ERROR_QUIET)
+    execute_process(COMMAND "${PROGRAM}" --rebase 0x10000 --output "${outDir}/train.hex" "${input}"
+        OUTPUT_QUIET ERROR_QUIET)
+endforeach()
+# The batch mode, with several workers
+execute_process(COMMAND "${PROGRAM}" ${inputs} OUTPUT_QUIET ERROR_QUIET)
+list(LENGTH inputs numInputs)
+message(STATUS "Trained on ${numInputs} files")
+
+if(LLVM_PROFDATA)
+    file(GLOB rawProfiles "${PGO_DIR}/*.profraw")
+    execute_process(COMMAND "${LLVM_PROFDATA}" merge -output=${PGO_DIR}/default.profdata ${rawProfiles}
+        RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "llvm-profdata failed")
+    endif()
+endif()
@@ -0,0 +1,221 @@
+/*
+HexFileInfo library - C interface to the parser (see hexfileinfo.h)
+
+The parser is the one in HexFileParser.cpp, which is linked into the library.
+Only the hfi_ functions are exported.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define HFI_BUILDING_LIBRARY
+#include "hexfileinfo.h"
+
+#include "../HexFileParser.h"
+#include <ranges>
+
+// hfi_image - The result of the last parse
+// The segment table is kept so the segments can be looked up by index, and
+// its memory is reused by later parses.
+struct hfi_image
+{
+    ImageInfo info;
+    std::vector<hfi_segment> segments;
+    std::string error;
+    std::vector<char> readBuffer;
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    std::unique_ptr<LazyImage> lazy;
+#endif
+};
+
+// parseStream - Parse an image in the given format
+static void parseStream(std::istream& input, bool uf2, hfi_format format, ImageInfo& info)
+{
+    if (uf2) {
+        processUf2File(input, info);
+    } else if (format == HFI_FORMAT_MULTI_HEX) {
+        info = parseMultiHexFile(input);
+    } else {
+        processHexFile(input, info);
+    }
+}
+
+// isUf2Format - Decide whether the input is UF2
+static bool isUf2Format(hfi_format format, const auto& isUf2)
+{
+    return format == HFI_FORMAT_UF2 || (format == HFI_FORMAT_AUTO && isUf2());
+}
+
+// parseImage - Call parse() to parse into the image, and make its segment table
+// No exceptions get out of here; they become the error message.
+static int parseImage(hfi_image* image, const char* inputName, const auto& parse)
+{
+    image->segments.clear();
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    image->lazy.reset();
+#endif
+    image->info = ImageInfo();
+    image->error.clear();
+    try {
+        inFileName = inputName;
+        parse(image->info);
+        for (const Chunk& chunk : std::ranges::reverse_view(image->info.chunks)) {
+            image->segments.push_back({ chunk.address, chunk.size, chunk.data.data() });
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        image->error = e.what();
+    } catch (...) {
+        image->error = "Error";
+    }
+    image->segments.clear();
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    image->lazy.reset();
+#endif
+    image->info = ImageInfo();
+    return -1;
+}
+
+extern "C" {
+
+uint32_t hfi_abi_version(void)
+{
+    return HFI_ABI_VERSION;
+}
+
+hfi_image* hfi_create(void)
+{
+    return new (std::nothrow) hfi_image;
+}
+
+void hfi_destroy(hfi_image* image)
+{
+    delete image;
+}
+
+int hfi_parse_file(hfi_image* image, const char* path, hfi_format format)
+{
+    return parseImage(image, path, [image, path, format](ImageInfo& info) {
+        bool uf2 = isUf2Format(format, [path] { return isUf2FileName(path); });
+        FileDescriptor file(path);
+        image->readBuffer.resize(0x10000);
+        FdStreamBuf streamBuf(file.get(), image->readBuffer);
+        std::istream input(&streamBuf);
+        parseStream(input, uf2, format, info);
+    });
+}
+
+int hfi_parse_fd(hfi_image* image, int fd, hfi_format format)
+{
+    return parseImage(image, "file descriptor", [image, fd, format](ImageInfo& info) {
+        image->readBuffer.resize(0x10000);
+        FdStreamBuf streamBuf(fd, image->readBuffer);
+        std::istream input(&streamBuf);
+        bool uf2 = isUf2Format(format, [&streamBuf] { return isUf2Data(streamBuf.peek()); });
+        parseStream(input, uf2, format, info);
+    });
+}
+
+int hfi_parse_buffer(hfi_image* image, const void* data, size_t size, hfi_format format)
+{
+    return parseImage(image, "buffer", [data, size, format](ImageInfo& info) {
+        auto bytes = std::span(static_cast<const char*>(data), size);
+        MemoryStreamBuf streamBuf(bytes.data(), bytes.size());
+        std::istream input(&streamBuf);
+        bool uf2 = isUf2Format(format, [bytes] { return isUf2Data(bytes); });
+        parseStream(input, uf2, format, info);
+    });
+}
+
+int hfi_parse_file_lazy(hfi_image* image, const char* path)
+{
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    int result = parseImage(image, path, [image, path](ImageInfo&) {
+        image->lazy = std::make_unique<LazyImage>(path);
+    });
+    if (result == 0) {
+        image->info = image->lazy->summary();
+        for (const LazyImage::Segment& segment : image->lazy->segments()) {
+            image->segments.push_back({ segment.address, segment.size, image->lazy->pointer(segment.address) });
+        }
+    }
+    return result;
+#else
+    return parseImage(image, path, [](ImageInfo&) {
+        throwError("Lazy images are only supported on Linux");
+    });
+#endif
+}
+
+size_t hfi_pages_decoded(const hfi_image* image)
+{
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    return image->lazy ? image->lazy->numPagesDecoded() : 0;
+#else
+    return 0;
+#endif
+}
+
+const char* hfi_error(const hfi_image* image)
+{
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    if (image->lazy && image->lazy->error()) {
+        return image->lazy->error();
+    }
+#endif
+    return image->error.c_str();
+}
+
+int hfi_get_summary(const hfi_image* image, hfi_summary* summary)
+{
+    const ImageInfo& info = image->info;
+    *summary = {};
+    summary->num_segments = uint32_t(image->segments.size());
+    summary->num_data_records = info.numDataRecords;
+    summary->max_data_size = info.maxDataSize;
+    summary->num_overlapping = info.numOverlapping;
+    summary->has_start_address = (info.numStartAddresses > 0);
+    summary->start_address = info.startAddress;
+    summary->found_eof = info.foundEof;
+    summary->is_uf2 = info.isUf2;
+    summary->num_family_ids = info.numFamilyIds;
+    summary->family_id = info.familyId;
+    summary->input_size = info.inputSize;
+    for (const hfi_segment& segment : image->segments) {
+        summary->data_size += segment.size;
+    }
+    return 0;
+}
+
+size_t hfi_segment_count(const hfi_image* image)
+{
+    return image->segments.size();
+}
+
+int hfi_get_segment(const hfi_image* image, size_t index, hfi_segment* segment)
+{
+    if (index >= image->segments.size()) {
+        return -1;
+    }
+    *segment = image->segments[index];
+    return 0;
+}
+
+} // extern "C"
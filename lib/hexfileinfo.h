@@ -0,0 +1,139 @@
+/*
+hexfileinfo.h - C interface to the HexFileInfo parser for Intel HEX and UF2 files
+
+Usage:
+    hfi_image* image = hfi_create();
+    if (hfi_parse_file(image, "firmware.hex", HFI_FORMAT_AUTO) != 0) {
+        fprintf(stderr, "%s\n", hfi_error(image));
+    }
+    hfi_segment segment;
+    for (size_t i = 0; hfi_get_segment(image, i, &segment) == 0; ++i) {
+        ... segment.address, segment.size, segment.data ...
+    }
+    hfi_destroy(image);
+
+An hfi_image holds the result of the last parse, and can be reused for any
+number of parses. All pointers returned by the library point into it, and are
+valid until the next parse or hfi_destroy. Parsing allocates a buffer for the
+data records as they're read (growing it, not allocating per record), then the
+data of each segment, and frees the previous image's data; the read buffer and
+the segment table are kept in the hfi_image and reused by later parses. The
+other functions don't allocate memory. Different hfi_images can be used in
+different threads at the same time.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef HEXFILEINFO_H
+#define HEXFILEINFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#ifdef HFI_BUILDING_LIBRARY
+#define HFI_API __declspec(dllexport)
+#else
+#define HFI_API __declspec(dllimport)
+#endif
+#else
+#define HFI_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Version of this interface; only changes in incompatible ways with the major version
+#define HFI_ABI_VERSION 1
+
+typedef struct hfi_image hfi_image;
+
+typedef enum hfi_format {
+    HFI_FORMAT_AUTO = 0, // UF2 for *.uf2 files or data that starts like a UF2 block, else HEX
+    HFI_FORMAT_HEX = 1,
+    HFI_FORMAT_UF2 = 2,
+    HFI_FORMAT_MULTI_HEX = 3 // several HEX images, each ending with an EOF record
+} hfi_format;
+
+// A contiguous block of data in the image
+typedef struct hfi_segment {
+    uint32_t address;
+    uint32_t size;
+    const uint8_t* data;
+} hfi_segment;
+
+// Summary of the image
+typedef struct hfi_summary {
+    uint32_t num_segments;
+    uint32_t num_data_records; // or UF2 blocks
+    uint32_t max_data_size; // largest amount of data in one record
+    uint32_t num_overlapping; // records that overlap earlier data
+    uint32_t has_start_address;
+    uint32_t start_address;
+    uint32_t found_eof;
+    uint32_t is_uf2;
+    uint32_t num_family_ids;
+    uint32_t family_id;
+    uint64_t input_size; // bytes
+    uint64_t data_size; // total bytes in all segments
+} hfi_summary;
+
+HFI_API uint32_t hfi_abi_version(void);
+
+// Create or destroy a reusable image; hfi_create returns NULL if out of memory
+HFI_API hfi_image* hfi_create(void);
+HFI_API void hfi_destroy(hfi_image* image);
+
+// Parse a file, an open file descriptor (read from its current position to the
+// end, and not closed), or data in memory (which needn't outlive the call).
+// Return 0 if successful, or -1 with a message from hfi_error.
+HFI_API int hfi_parse_file(hfi_image* image, const char* path, hfi_format format);
+HFI_API int hfi_parse_fd(hfi_image* image, int fd, hfi_format format);
+HFI_API int hfi_parse_buffer(hfi_image* image, const void* data, size_t size, hfi_format format);
+
+// Open a HEX file (not UF2 or multi-image) without decoding its data (Linux only).
+// The segments' data is decoded a page at a time when it's first read, so huge
+// images cost little until they're used. Only the record headers are checked
+// here; errors in the data are reported by hfi_error once the page is read,
+// and the bad record reads as 0. Reading the data from another process or from
+// inside a system call (e.g. write) needs vm.unprivileged_userfaultfd=1 or
+// CAP_SYS_PTRACE.
+HFI_API int hfi_parse_file_lazy(hfi_image* image, const char* path);
+
+// Number of pages decoded so far by a lazy image
+HFI_API size_t hfi_pages_decoded(const hfi_image* image);
+
+// Error message from the last parse, or "" if it succeeded
+// (or for a lazy image, the first error found while decoding its data)
+HFI_API const char* hfi_error(const hfi_image* image);
+
+// Results of the last successful parse; segments are in order of address.
+// hfi_get_segment returns -1 if index is out of range.
+HFI_API int hfi_get_summary(const hfi_image* image, hfi_summary* summary);
+HFI_API size_t hfi_segment_count(const hfi_image* image);
+HFI_API int hfi_get_segment(const hfi_image* image, size_t index, hfi_segment* segment);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HEXFILEINFO_H
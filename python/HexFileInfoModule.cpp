@@ -0,0 +1,484 @@
+/*
+HexFileInfo Python module - Parse Intel HEX and UF2 files from Python
+
+The parser is the one in HexFileParser.cpp, which is linked into the module.
+The data of each segment is exposed through the buffer protocol, so
+memoryview(segment) and numpy.frombuffer(segment, numpy.uint8) don't copy it.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "../HexFileParser.h"
+#include <fstream>
+#include <ranges>
+
+static PyObject* hexFileError = nullptr;
+static PyTypeObject* imageType = nullptr;
+static PyTypeObject* segmentType = nullptr;
+
+// ParseRequest - What to parse, and the result
+// The parsing is done without the GIL, so this has no Python objects.
+struct ParseRequest
+{
+    std::string fileName; // or a description of the data
+    std::span<const char> data; // if not from a file
+    bool fromFile = true;
+    bool uf2 = false;
+    bool multi = false;
+    ImageInfo info;
+    std::string error;
+};
+
+// parseRequest - Parse a file or data, and put any error message in the request
+static void parseRequest(ParseRequest& request)
+{
+    try {
+        inFileName = request.fileName;
+        if (request.uf2 && request.multi) {
+            throwError("multi can only be used with hex files");
+        }
+        std::ifstream inFile;
+        MemoryStreamBuf memoryBuf(request.data.data(), request.data.size());
+        std::istream memoryInput(&memoryBuf);
+        if (request.fromFile) {
+            inFile.open(request.fileName, std::ios::binary);
+            if (!inFile) {
+                throwFileError("Failed to open file", request.fileName);
+            }
+        }
+        std::istream& input = request.fromFile ? inFile : memoryInput;
+        if (request.uf2) {
+            processUf2File(input, request.info);
+        } else if (request.multi) {
+            request.info = parseMultiHexFile(input);
+        } else {
+            processHexFile(input, request.info);
+        }
+    } catch (const std::exception& e) {
+        request.error = e.what();
+    } catch (...) {
+        request.error = "Error";
+    }
+}
+
+// Image - Python object for a parsed image
+
+struct ImageObject
+{
+    PyObject_HEAD
+    ImageInfo info;
+};
+
+static PyObject* makeImage(ImageInfo&& info)
+{
+    auto self = reinterpret_cast<ImageObject*>(imageType->tp_alloc(imageType, 0));
+    if (self) {
+        new (&self->info) ImageInfo(std::move(info));
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void imageDealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    reinterpret_cast<ImageObject*>(self)->info.~ImageInfo();
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static const ImageInfo& getInfo(PyObject* self)
+{
+    return reinterpret_cast<ImageObject*>(self)->info;
+}
+
+// Segment - Python object for one data segment of an image
+// It keeps a reference to the image, which owns the data.
+
+struct SegmentObject
+{
+    PyObject_HEAD
+    PyObject* image;
+    const Chunk* chunk;
+};
+
+static PyObject* makeSegment(PyObject* image, const Chunk& chunk)
+{
+    auto self = reinterpret_cast<SegmentObject*>(segmentType->tp_alloc(segmentType, 0));
+    if (self) {
+        Py_INCREF(image);
+        self->image = image;
+        self->chunk = &chunk;
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+static void segmentDealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    Py_XDECREF(reinterpret_cast<SegmentObject*>(self)->image);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static const Chunk& getChunk(PyObject* self)
+{
+    return *reinterpret_cast<SegmentObject*>(self)->chunk;
+}
+
+static PyObject* imageGetSegments(PyObject* self, void*)
+{
+    const ImageInfo& info = getInfo(self);
+    PyObject* list = PyList_New(Py_ssize_t(info.chunks.size()));
+    if (!list) {
+        return nullptr;
+    }
+    Py_ssize_t iSegment = 0;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        PyObject* segment = makeSegment(self, chunk);
+        if (!segment) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, iSegment++, segment);
+    }
+    return list;
+}
+
+static PyObject* imageGetStartAddress(PyObject* self, void*)
+{
+    const ImageInfo& info = getInfo(self);
+    if (info.numStartAddresses == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromUnsignedLong(info.startAddress);
+}
+
+static PyObject* imageGetFamilyId(PyObject* self, void*)
+{
+    const ImageInfo& info = getInfo(self);
+    if (info.numFamilyIds == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromUnsignedLong(info.familyId);
+}
+
+static PyObject* imageGetRecordCounts(PyObject* self, void*)
+{
+    const ImageInfo& info = getInfo(self);
+    PyObject* dict = PyDict_New();
+    for (size_t iType = 0; dict && iType < std::size(recordTypeNames); ++iType) {
+        PyObject* count = PyLong_FromUnsignedLong(info.recordCounts[iType]);
+        if (!count || PyDict_SetItemString(dict, recordTypeNames[iType], count) != 0) {
+            Py_XDECREF(count);
+            Py_CLEAR(dict);
+            break;
+        }
+        Py_DECREF(count);
+    }
+    return dict;
+}
+
+static PyObject* imageGetDataSize(PyObject* self, void*)
+{
+    uint64_t size = 0;
+    for (const Chunk& chunk : getInfo(self).chunks) {
+        size += chunk.size;
+    }
+    return PyLong_FromUnsignedLongLong(size);
+}
+
+#define IMAGE_UNSIGNED_GETTER(name, field) \
+    static PyObject* name(PyObject* self, void*) { return PyLong_FromUnsignedLongLong(getInfo(self).field); }
+IMAGE_UNSIGNED_GETTER(imageGetNumDataRecords, numDataRecords)
+IMAGE_UNSIGNED_GETTER(imageGetMaxDataSize, maxDataSize)
+IMAGE_UNSIGNED_GETTER(imageGetNumOverlapping, numOverlapping)
+IMAGE_UNSIGNED_GETTER(imageGetInputSize, inputSize)
+#undef IMAGE_UNSIGNED_GETTER
+
+static PyObject* imageGetFoundEof(PyObject* self, void*)
+{
+    return PyBool_FromLong(getInfo(self).foundEof);
+}
+
+static PyObject* imageGetIsUf2(PyObject* self, void*)
+{
+    return PyBool_FromLong(getInfo(self).isUf2);
+}
+
+static PyObject* imageRepr(PyObject* self)
+{
+    const ImageInfo& info = getInfo(self);
+    return PyUnicode_FromString(std::format("<hexfileinfo.Image: {} segments, {} data records>",
+        info.chunks.size(), info.numDataRecords).c_str());
+}
+
+static PyGetSetDef imageGetSet[] = {
+    { "segments", imageGetSegments, nullptr, "Data segments in order of address", nullptr },
+    { "start_address", imageGetStartAddress, nullptr, "Start address, or None", nullptr },
+    { "data_size", imageGetDataSize, nullptr, "Total number of data bytes", nullptr },
+    { "data_records", imageGetNumDataRecords, nullptr, "Number of data records or UF2 blocks", nullptr },
+    { "max_record_size", imageGetMaxDataSize, nullptr, "Largest amount of data in a record", nullptr },
+    { "overlapping", imageGetNumOverlapping, nullptr, "Number of records that overlap others", nullptr },
+    { "found_eof", imageGetFoundEof, nullptr, "True if the image ended properly", nullptr },
+    { "input_size", imageGetInputSize, nullptr, "Size of the input in bytes", nullptr },
+    { "record_counts", imageGetRecordCounts, nullptr, "Number of records of each type", nullptr },
+    { "is_uf2", imageGetIsUf2, nullptr, "True if the input was a UF2 file", nullptr },
+    { "family_id", imageGetFamilyId, nullptr, "UF2 family ID, or None", nullptr },
+    { nullptr, nullptr, nullptr, nullptr, nullptr }
+};
+
+static PyType_Slot imageSlots[] = {
+    { Py_tp_doc, const_cast<char*>("Parsed HEX or UF2 image") },
+    { Py_tp_dealloc, reinterpret_cast<void*>(imageDealloc) },
+    { Py_tp_repr, reinterpret_cast<void*>(imageRepr) },
+    { Py_tp_getset, imageGetSet },
+    { 0, nullptr }
+};
+
+static PyObject* segmentGetAddress(PyObject* self, void*)
+{
+    return PyLong_FromUnsignedLong(getChunk(self).address);
+}
+
+static PyObject* segmentGetSize(PyObject* self, void*)
+{
+    return PyLong_FromUnsignedLong(getChunk(self).size);
+}
+
+static Py_ssize_t segmentLength(PyObject* self)
+{
+    return Py_ssize_t(getChunk(self).size);
+}
+
+static int segmentGetBuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    const Chunk& chunk = getChunk(self);
+    return PyBuffer_FillInfo(view, self, const_cast<unsigned char*>(chunk.data.data()),
+        Py_ssize_t(chunk.size), 1, flags);
+}
+
+static PyObject* segmentRepr(PyObject* self)
+{
+    const Chunk& chunk = getChunk(self);
+    return PyUnicode_FromString(std::format("<hexfileinfo.Segment: address 0x{:X}, size 0x{:X}>",
+        chunk.address, chunk.size).c_str());
+}
+
+static PyGetSetDef segmentGetSet[] = {
+    { "address", segmentGetAddress, nullptr, "Start address", nullptr },
+    { "size", segmentGetSize, nullptr, "Number of data bytes", nullptr },
+    { nullptr, nullptr, nullptr, nullptr, nullptr }
+};
+
+static PyType_Slot segmentSlots[] = {
+    { Py_tp_doc, const_cast<char*>("Contiguous data in an image; supports the buffer protocol") },
+    { Py_tp_dealloc, reinterpret_cast<void*>(segmentDealloc) },
+    { Py_tp_repr, reinterpret_cast<void*>(segmentRepr) },
+    { Py_tp_getset, segmentGetSet },
+    { Py_mp_length, reinterpret_cast<void*>(segmentLength) },
+    { Py_bf_getbuffer, reinterpret_cast<void*>(segmentGetBuffer) },
+    { 0, nullptr }
+};
+
+const unsigned long typeFlags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION;
+
+static PyType_Spec imageSpec = { "hexfileinfo.Image", sizeof(ImageObject), 0, typeFlags, imageSlots };
+static PyType_Spec segmentSpec = { "hexfileinfo.Segment", sizeof(SegmentObject), 0, typeFlags, segmentSlots };
+
+// makeResult - Make an Image from a parsed request, or an exception object if it failed
+static PyObject* makeResult(ParseRequest& request)
+{
+    if (!request.error.empty()) {
+        return PyObject_CallFunction(hexFileError, "s", request.error.c_str());
+    }
+    return makeImage(std::move(request.info));
+}
+
+// setRequestSource - Set the file name or data to parse from a Python object
+// Strings and path-like objects are file names; bytes-like objects are data, and
+// the buffer must be released when the request is done.
+static bool setRequestSource(PyObject* source, ParseRequest& request, Py_buffer& buffer)
+{
+    if (PyUnicode_Check(source) || PyObject_HasAttrString(source, "__fspath__")) {
+        PyObject* path = nullptr;
+        if (!PyUnicode_FSConverter(source, &path)) {
+            return false;
+        }
+        request.fileName = PyBytes_AS_STRING(path);
+        Py_DECREF(path);
+        request.fromFile = true;
+        request.uf2 = isUf2FileName(request.fileName);
+        return true;
+    }
+    if (PyObject_GetBuffer(source, &buffer, PyBUF_SIMPLE) != 0) {
+        PyErr_SetString(PyExc_TypeError, "source must be a path or a bytes-like object");
+        return false;
+    }
+    request.fileName = "data";
+    request.data = std::span(static_cast<const char*>(buffer.buf), size_t(buffer.len));
+    request.fromFile = false;
+    request.uf2 = isUf2Data(request.data);
+    return true;
+}
+
+PyDoc_STRVAR(parseDoc,
+"parse(source, *, uf2=None, multi=False)\n--\n\n"
+"Parse a HEX or UF2 file and return an Image.\n"
+"source is a file path, or a bytes-like object containing the file.\n"
+"uf2 selects the format; by default it's UF2 for *.uf2 files or data that\n"
+"starts like a UF2 block. multi allows several images in a HEX file.\n"
+"Raises HexFileError if the file is invalid.");
+
+static PyObject* parse(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "source", "uf2", "multi", nullptr };
+    PyObject* source = nullptr;
+    PyObject* uf2 = Py_None;
+    int multi = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$Op", const_cast<char**>(keywords), &source, &uf2, &multi)) {
+        return nullptr;
+    }
+    ParseRequest request;
+    Py_buffer buffer = {};
+    if (!setRequestSource(source, request, buffer)) {
+        return nullptr;
+    }
+    if (uf2 != Py_None) {
+        int isTrue = PyObject_IsTrue(uf2);
+        if (isTrue < 0) {
+            PyBuffer_Release(&buffer);
+            return nullptr;
+        }
+        request.uf2 = isTrue;
+    }
+    request.multi = multi;
+    Py_BEGIN_ALLOW_THREADS
+    parseRequest(request);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buffer);
+    if (!request.error.empty()) {
+        PyErr_SetString(hexFileError, request.error.c_str());
+        return nullptr;
+    }
+    return makeImage(std::move(request.info));
+}
+
+PyDoc_STRVAR(parseFilesDoc,
+"parse_files(paths, *, jobs=0, multi=False)\n--\n\n"
+"Parse several HEX or UF2 files at once, using jobs threads (default: the\n"
+"number of CPU cores). Returns a list with an Image for each file, or a\n"
+"HexFileError for each file that is invalid.");
+
+static PyObject* parseFiles(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "paths", "jobs", "multi", nullptr };
+    PyObject* paths = nullptr;
+    unsigned jobs = 0;
+    int multi = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$Ip", const_cast<char**>(keywords), &paths, &jobs, &multi)) {
+        return nullptr;
+    }
+    PyObject* pathList = PySequence_Fast(paths, "paths must be a sequence");
+    if (!pathList) {
+        return nullptr;
+    }
+    size_t numFiles = size_t(PySequence_Fast_GET_SIZE(pathList));
+    std::vector<ParseRequest> requests(numFiles);
+    for (size_t iFile = 0; iFile < numFiles; ++iFile) {
+        PyObject* path = nullptr;
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(pathList, iFile), &path)) {
+            Py_DECREF(pathList);
+            return nullptr;
+        }
+        requests[iFile].fileName = PyBytes_AS_STRING(path);
+        requests[iFile].uf2 = isUf2FileName(requests[iFile].fileName);
+        requests[iFile].multi = multi;
+        Py_DECREF(path);
+    }
+    Py_DECREF(pathList);
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Py_BEGIN_ALLOW_THREADS
+    std::atomic<size_t> nextFile = 0;
+    std::vector<std::jthread> threads;
+    for (unsigned iThread = 0; iThread < std::min<size_t>(jobs, numFiles); ++iThread) {
+        threads.emplace_back([&] {
+            for (size_t iFile; (iFile = nextFile++) < numFiles;) {
+                parseRequest(requests[iFile]);
+            }
+        });
+    }
+    threads.clear();
+    Py_END_ALLOW_THREADS
+    PyObject* list = PyList_New(Py_ssize_t(numFiles));
+    for (size_t iFile = 0; list && iFile < numFiles; ++iFile) {
+        PyObject* result = makeResult(requests[iFile]);
+        if (!result) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, Py_ssize_t(iFile), result);
+    }
+    return list;
+}
+
+static PyMethodDef moduleMethods[] = {
+    { "parse", reinterpret_cast<PyCFunction>(reinterpret_cast<void*>(parse)), METH_VARARGS | METH_KEYWORDS, parseDoc },
+    { "parse_files", reinterpret_cast<PyCFunction>(reinterpret_cast<void*>(parseFiles)), METH_VARARGS | METH_KEYWORDS, parseFilesDoc },
+    { nullptr, nullptr, 0, nullptr }
+};
+
+static PyModuleDef moduleDef = {
+    PyModuleDef_HEAD_INIT,
+    "hexfileinfo",
+    "Read and validate Intel HEX and UF2 files",
+    -1,
+    moduleMethods,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr
+};
+
+PyMODINIT_FUNC PyInit_hexfileinfo()
+{
+    PyObject* module = PyModule_Create(&moduleDef);
+    if (!module) {
+        return nullptr;
+    }
+    hexFileError = PyErr_NewExceptionWithDoc("hexfileinfo.HexFileError",
+        "The file could not be read or is not valid", PyExc_ValueError, nullptr);
+    imageType = reinterpret_cast<PyTypeObject*>(PyType_FromSpec(&imageSpec));
+    segmentType = reinterpret_cast<PyTypeObject*>(PyType_FromSpec(&segmentSpec));
+    if (!hexFileError || !imageType || !segmentType
+        || PyModule_AddObjectRef(module, "HexFileError", hexFileError) != 0
+        || PyModule_AddObjectRef(module, "Image", reinterpret_cast<PyObject*>(imageType)) != 0
+        || PyModule_AddObjectRef(module, "Segment", reinterpret_cast<PyObject*>(segmentType)) != 0)
+    {
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,31 @@
+# Image cache test: process the same file several times in one batch with
+# --cache-size, so all but the first use the cached image, and check that each
+# gives the same output. --insert-crc changes the image, so on a cache hit it
+# works on a copy; this fails if a hit loses anything that the first parse made.
+#
+# Variables: PROGRAM, INPUT
+
+execute_process(
+    COMMAND "${PROGRAM}" --cache-size 16 --insert-crc 0x10000100 --range 0x10000000:0x10000100
+        "${INPUT}" "${INPUT}" "${INPUT}"
+    OUTPUT_VARIABLE output
+    RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "HexFileInfo failed (${result}):\n${output}")
+endif()
+
+string(REPLACE "HEX file: " ";" reports "${output}")
+list(REMOVE_ITEM reports "")
+list(LENGTH reports numReports)
+if(NOT numReports EQUAL 3)
+    message(FATAL_ERROR "Expected 3 reports:\n${output}")
+endif()
+list(GET reports 0 first)
+if(NOT first MATCHES "CRC-32")
+    message(FATAL_ERROR "No CRC in the report:\n${output}")
+endif()
+foreach(report IN LISTS reports)
+    if(NOT report STREQUAL first)
+        message(FATAL_ERROR "Cached image gave different output:\n${output}")
+    endif()
+endforeach()
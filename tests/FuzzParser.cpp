@@ -0,0 +1,414 @@
+/*
+FuzzParser - Differential fuzz test of the parsers in HexFileParser.cpp
+
+Usage: FuzzParser [--iterations N] [--seed N] [FILE...]
+
+Each input is parsed by every parser that can read it, and the results must
+agree exactly: processHexFile with and without the data, parseMultiHexFile, and
+LazyImage (where userfaultfd is available) must give the same segments, data,
+record counts, overlap counts and errors (with their line numbers). UF2 parsing
+with and without the data must agree too. A disagreement aborts, after saving
+the input to FuzzParser-failure.bin.
+
+Built with HEXFILEINFO_LIBFUZZER (see HEXFILEINFO_FUZZ in CMakeLists.txt), this
+is a libFuzzer target. Otherwise it runs the given files, then N inputs made by
+mutating them and a generated file, from a fixed seed so that a run can be
+repeated.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../HexFileParser.h"
+#include <ranges>
+#include <fstream>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <cstdlib>
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+#include <unistd.h>
+#endif
+
+// The input being tested, saved if a check fails
+static std::string_view currentInput;
+
+// fail - Report a failed check, save the input, and abort (so libFuzzer keeps it too)
+[[noreturn]] static void fail(const char* condition, int line)
+{
+    std::cerr << std::format("FuzzParser line {}: check failed: {}\n", line, condition);
+    std::ofstream("FuzzParser-failure.bin", std::ios::binary).write(currentInput.data(), std::streamsize(currentInput.size()));
+    std::cerr << "Input saved in FuzzParser-failure.bin\n";
+    std::abort();
+}
+
+// EXPECT - Fail if the condition is false
+#define EXPECT(condition) \
+    do { \
+        if (!(condition)) { \
+            fail(#condition, __LINE__); \
+        } \
+    } while (false)
+
+// Result - The image from a parser, or its error
+struct Result
+{
+    std::optional<ImageInfo> info;
+    std::string error;
+};
+
+// parse - Run a parser, catching its error
+static Result parse(const auto& parser)
+{
+    Result result;
+    try {
+        result.info = parser();
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    return result;
+}
+
+// errorLine - Get the line number of a parse error, or 0 if it has none
+static unsigned errorLine(std::string_view error)
+{
+    size_t pos = error.find("\nLine ");
+    return pos == error.npos ? 0 : unsigned(std::strtoul(error.data() + pos + 6, nullptr, 10));
+}
+
+// expectSameImage - Check that two parsers gave the same image
+// The data is only compared if both kept it.
+static void expectSameImage(const ImageInfo& a, const ImageInfo& b, bool compareData)
+{
+    EXPECT(a.chunks.size() == b.chunks.size());
+    for (auto [chunkA, chunkB] = std::pair(a.chunks.begin(), b.chunks.begin()); chunkA != a.chunks.end(); ++chunkA, ++chunkB) {
+        EXPECT(chunkA->address == chunkB->address);
+        EXPECT(chunkA->size == chunkB->size);
+        if (compareData) {
+            EXPECT(chunkA->data.size() == chunkA->size);
+            EXPECT(std::ranges::equal(chunkA->data, chunkB->data));
+        }
+    }
+    EXPECT(a.numOverlapping == b.numOverlapping);
+    EXPECT(a.foundEof == b.foundEof);
+    EXPECT(a.hasSegmentRecords == b.hasSegmentRecords);
+    EXPECT(a.numStartAddresses == b.numStartAddresses);
+    EXPECT(a.startAddress == b.startAddress);
+    EXPECT(a.numDataRecords == b.numDataRecords);
+    EXPECT(a.maxDataSize == b.maxDataSize);
+    EXPECT(std::ranges::equal(a.recordCounts, b.recordCounts));
+}
+
+// isDeferredError - Check whether an error from the eager parser can be one
+// that LazyImage only finds when it decodes the data
+static bool isDeferredError(std::string_view error)
+{
+    return error.starts_with("Incorrect checksum") || error.starts_with("Invalid data in hex file");
+}
+
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+// checkLazy - Check that a LazyImage of the text agrees with the eager parser
+static void checkLazy(std::string_view text, const Result& eager)
+{
+    static const std::string fileName =
+        (std::filesystem::temp_directory_path() / std::format("FuzzParser-{}.hex", ::getpid())).string();
+    std::ofstream(fileName, std::ios::binary).write(text.data(), std::streamsize(text.size()));
+    std::unique_ptr<LazyImage> lazy;
+    std::string lazyError;
+    try {
+        lazy = std::make_unique<LazyImage>(fileName);
+    } catch (const std::exception& e) {
+        lazyError = e.what();
+    }
+    std::filesystem::remove(fileName);
+    if (lazyError.starts_with("userfaultfd")) {
+        return;
+    }
+    if (!lazy) {
+        // The data records' checksums and digits are checked later by LazyImage,
+        // so the eager parser may stop at an earlier line.
+        EXPECT(!eager.info);
+        EXPECT(lazyError == eager.error || (isDeferredError(eager.error) && errorLine(lazyError) > errorLine(eager.error)));
+        return;
+    }
+    // Decode every page, in order of address.
+    ImageInfo lazyInfo = lazy->summary();
+    for (const LazyImage::Segment& segment : std::ranges::reverse_view(lazy->segments())) {
+        const unsigned char* data = lazy->pointer(segment.address);
+        lazyInfo.chunks.push_back({ segment.address, segment.size, ChunkData(data, data + segment.size) });
+    }
+    if (!eager.info) {
+        EXPECT(isDeferredError(eager.error));
+        EXPECT(lazy->error() != nullptr);
+        return;
+    }
+    EXPECT(lazy->error() == nullptr);
+    expectSameImage(*eager.info, lazyInfo, true);
+}
+#endif
+
+// checkHex - Check that the hex parsers agree about the text
+static void checkHex(std::string_view text)
+{
+    auto eagerParser = [text](bool keepData) {
+        return [text, keepData] {
+            ReadStream input{ ReadBuffer(text) };
+            ImageInfo info;
+            processHexFile(input, info, keepData);
+            return info;
+        };
+    };
+    Result eager = parse(eagerParser(true));
+    Result layout = parse(eagerParser(false));
+    EXPECT(eager.error == layout.error);
+    if (eager.info) {
+        EXPECT(layout.info.has_value());
+        expectSameImage(*eager.info, *layout.info, false);
+        for (const Chunk& chunk : layout.info->chunks) {
+            EXPECT(chunk.data.empty());
+        }
+    }
+    // A multi-image file with one image is the same as a single image. The
+    // multi-image parser only differs when the text goes on after an EOF record.
+    if (!eager.error.starts_with("EOF record before end of file")) {
+        Result multi = parse([text] {
+            ReadStream input{ ReadBuffer(text) };
+            return parseMultiHexFile(input);
+        });
+        EXPECT(multi.error == eager.error);
+        if (eager.info) {
+            EXPECT(multi.info.has_value());
+            expectSameImage(*eager.info, *multi.info, true);
+        }
+    }
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    checkLazy(text, eager);
+#endif
+}
+
+// checkUf2 - Check that the UF2 parser gives the same layout without the data
+static void checkUf2(std::string_view data)
+{
+    auto uf2Parser = [data](bool keepData) {
+        return [data, keepData] {
+            ReadStream input{ ReadBuffer(data) };
+            ImageInfo info;
+            processUf2File(input, info, keepData);
+            return info;
+        };
+    };
+    Result withData = parse(uf2Parser(true));
+    Result layout = parse(uf2Parser(false));
+    EXPECT(withData.error == layout.error);
+    if (withData.info) {
+        EXPECT(layout.info.has_value());
+        expectSameImage(*withData.info, *layout.info, false);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    currentInput = std::string_view(reinterpret_cast<const char*>(data), size);
+    checkHex(currentInput);
+    checkUf2(currentInput);
+    return 0;
+}
+
+#ifndef HEXFILEINFO_LIBFUZZER
+// Standalone driver: mutations of the given files and a generated file
+
+// makeRecord - Format one record with a correct checksum
+static std::string makeRecord(unsigned recordType, unsigned address, std::span<const unsigned char> data)
+{
+    std::string record = std::format(":{:02X}{:04X}{:02X}", data.size(), address & 0xFFFF, recordType);
+    unsigned char checksum = static_cast<unsigned char>(data.size() + (address >> 8) + address + recordType);
+    for (unsigned char byte : data) {
+        record += std::format("{:02X}", byte);
+        checksum += byte;
+    }
+    return record + std::format("{:02X}", static_cast<unsigned char>(-checksum));
+}
+
+// randomRecord - Make a valid record of any type, mostly data
+static std::string randomRecord(std::mt19937& random)
+{
+    static const unsigned types[] = { typeData, typeData, typeData, typeData, typeEla, typeEsa, typeSla, typeSsa, typeEof };
+    unsigned recordType = types[random() % std::size(types)];
+    size_t size = recordType == typeData ? random() % 40 : recordType == typeEla || recordType == typeEsa ? 2 : recordType == typeEof ? 0 : 4;
+    std::vector<unsigned char> data(size);
+    for (unsigned char& byte : data) {
+        byte = static_cast<unsigned char>(random());
+    }
+    // Keep most addresses close together so that records overlap and touch.
+    unsigned address = (random() % 4 == 0) ? unsigned(random()) : unsigned(random() % 0x200);
+    return makeRecord(recordType, address, data);
+}
+
+// makeGeneratedText - Make a valid hex file of random records
+static std::string makeGeneratedText(std::mt19937& random)
+{
+    std::string text;
+    for (unsigned i = 0; i < 300; ++i) {
+        std::string record = randomRecord(random);
+        if (record.substr(7, 2) != "01") {
+            text += record + "\n";
+        }
+    }
+    return text + ":00000001FF\n";
+}
+
+// splitLines - Split text into lines, keeping their line endings
+static std::vector<std::string> splitLines(std::string_view text)
+{
+    std::vector<std::string> lines;
+    for (size_t pos = 0; pos < text.size();) {
+        size_t next = std::min(text.find('\n', pos), text.size() - 1) + 1;
+        lines.emplace_back(text.substr(pos, next - pos));
+        pos = next;
+    }
+    return lines;
+}
+
+// fixChecksum - Correct the checksum of a line, if it looks like a record
+static void fixChecksum(std::string& line)
+{
+    std::string_view record = line;
+    bool crlf = record.ends_with("\r\n");
+    record.remove_suffix(crlf ? 2 : record.ends_with('\n') ? 1 : 0);
+    if (record.size() < 11 || record.size() % 2 == 0 || record.front() != ':'
+        || !std::ranges::all_of(record.substr(1), [](char ch) { return hexDigitValues[static_cast<unsigned char>(ch)] >= 0; }))
+    {
+        return;
+    }
+    unsigned char sum = 0;
+    for (size_t i = 1; i + 2 < record.size(); i += 2) {
+        sum += static_cast<unsigned char>(fromHex(std::span(record.substr(i, 2))));
+    }
+    line.replace(record.size() - 2, 2, std::format("{:02X}", static_cast<unsigned char>(-sum)));
+}
+
+// mutate - Make a random change to the text
+static void mutate(std::string& text, std::mt19937& random)
+{
+    static const char chars[] = ":0123456789ABCDEFabcdefG\r\n ";
+    std::vector<std::string> lines = splitLines(text);
+    auto randomLine = [&]() -> std::string& { return lines[random() % lines.size()]; };
+    switch (lines.empty() ? 0 : random() % 8) {
+    case 0:
+        // Insert a valid record
+        lines.insert(lines.begin() + (lines.empty() ? 0 : random() % (lines.size() + 1)), randomRecord(random) + "\n");
+        break;
+    case 1:
+        // Delete a line
+        lines.erase(lines.begin() + random() % lines.size());
+        break;
+    case 2:
+        // Duplicate a line
+        lines.insert(lines.begin() + random() % lines.size(), randomLine());
+        break;
+    case 3:
+        // Swap two lines
+        std::swap(randomLine(), randomLine());
+        break;
+    case 4:
+    case 5: {
+        // Change a hex digit, keeping the checksum correct so the record gets
+        // past it most of the time
+        std::string& line = randomLine();
+        if (line.size() > 1) {
+            line[1 + random() % (line.size() - 1)] = "0123456789ABCDEF"[random() % 16];
+            fixChecksum(line);
+        }
+        break;
+    }
+    case 6: {
+        // Change any character
+        std::string& line = randomLine();
+        if (!line.empty()) {
+            line[random() % line.size()] = chars[random() % (std::size(chars) - 1)];
+        }
+        break;
+    }
+    default:
+        // Cut the text short
+        lines.resize(random() % lines.size());
+        if (!lines.empty() && random() % 2) {
+            std::string& line = lines.back();
+            line.resize(random() % (line.size() + 1));
+        }
+        break;
+    }
+    text.clear();
+    for (const std::string& line : lines) {
+        text += line;
+    }
+}
+
+// testInput - Run one input through the checks
+static void testInput(std::string_view input)
+{
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned numIterations = 1000;
+    unsigned seed = 1;
+    std::vector<std::string> seeds;
+    try {
+        for (int iArg = 1; iArg < argc; ++iArg) {
+            std::string_view arg = argv[iArg];
+            if (arg == "--iterations" && iArg + 1 < argc) {
+                numIterations = unsigned(std::stoul(argv[++iArg]));
+            } else if (arg == "--seed" && iArg + 1 < argc) {
+                seed = unsigned(std::stoul(argv[++iArg]));
+            } else {
+                inFileName = argv[iArg];
+                std::ifstream file(inFileName, std::ios::binary);
+                if (!file) {
+                    throwFileError("Failed to open file", inFileName);
+                }
+                seeds.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                testInput(seeds.back());
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << std::format("FuzzParser: Error: {}\n", e.what());
+        return 2;
+    }
+    std::mt19937 random(seed);
+    seeds.push_back(makeGeneratedText(random));
+    for (unsigned i = 0; i < numIterations; ++i) {
+        std::string text = seeds[i % seeds.size()];
+        for (unsigned iMutation = 1 + random() % 4; iMutation > 0; --iMutation) {
+            mutate(text, random);
+        }
+        // Sometimes with Windows line endings
+        if (random() % 8 == 0) {
+            for (size_t pos = 0; (pos = text.find('\n', pos)) != text.npos; pos += 2) {
+                text.insert(pos, 1, '\r');
+            }
+        }
+        testInput(text);
+    }
+    std::cout << std::format("{} inputs checked\n", numIterations + seeds.size() - 1);
+    return 0;
+}
+#endif
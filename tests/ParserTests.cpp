@@ -0,0 +1,390 @@
+/*
+ParserTests - Tests of the parser in HexFileParser.cpp
+
+Usage: ParserTests [TEST...]
+
+Runs the named tests, or all of them, and shows the ones that fail. The exit
+status is 1 if any failed, or else 77 if any were skipped because they can't run
+on this system. CMake registers each test with CTest.
+
+Copyright (c) 2023 Len Popp
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../HexFileParser.h"
+#include <ranges>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+
+// CHECK - Fail the current test if the condition is false
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            throwError(std::format("line {}: check failed: {}", __LINE__, #condition).c_str()); \
+        } \
+    } while (false)
+
+// TestSkipped - Thrown by a test that can't run on this system
+struct TestSkipped : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// makeRecord - Format one record of a hex file
+static std::string makeRecord(recordType_t recordType, unsigned address, std::span<const unsigned char> data)
+{
+    std::string record = std::format(":{:02X}{:04X}{:02X}", data.size(), address & 0xFFFF, int(recordType));
+    unsigned char checksum = static_cast<unsigned char>(data.size() + (address >> 8) + address + recordType);
+    for (unsigned char byte : data) {
+        record += std::format("{:02X}", byte);
+        checksum += byte;
+    }
+    return record + std::format("{:02X}\n", static_cast<unsigned char>(-checksum));
+}
+
+// makeHexText - Make a hex file with a data record for each of the given
+// addresses, where the data at each address is the low byte of the address
+static std::string makeHexText(const std::vector<unsigned>& addresses, unsigned recordSize)
+{
+    std::string text;
+    unsigned upper = ~0u;
+    for (unsigned address : addresses) {
+        if (address >> 16 != upper) {
+            upper = address >> 16;
+            const unsigned char upperBytes[] = { static_cast<unsigned char>(upper >> 8), static_cast<unsigned char>(upper) };
+            text += makeRecord(typeEla, 0, upperBytes);
+        }
+        std::vector<unsigned char> data(recordSize);
+        for (unsigned i = 0; i < recordSize; ++i) {
+            data[i] = static_cast<unsigned char>(address + i);
+        }
+        text += makeRecord(typeData, address, data);
+    }
+    return text + makeRecord(typeEof, 0, {});
+}
+
+static ImageInfo parseText(const std::string& text, bool keepData = true)
+{
+    std::istringstream input(text);
+    ImageInfo info;
+    processHexFile(input, info, keepData);
+    return info;
+}
+
+// checkContiguous - Check that an image is one chunk of the given size at address 0,
+// with the data made by makeHexText
+static void checkContiguous(const ImageInfo& info, unsigned size)
+{
+    CHECK(info.chunks.size() == 1);
+    const Chunk& chunk = info.chunks.front();
+    CHECK(chunk.address == 0);
+    CHECK(chunk.size == size);
+    CHECK(chunk.data.size() == size);
+    for (unsigned i = 0; i < size; ++i) {
+        CHECK(chunk.data[i] == static_cast<unsigned char>(i));
+    }
+    CHECK(info.numOverlapping == 0);
+}
+
+// testDescending - Records in descending order of address make one chunk, quickly
+// (CMake gives this test a timeout, which the old quadratic merging went far over)
+static void testDescending()
+{
+    const unsigned size = 0x400000;
+    std::vector<unsigned> addresses;
+    for (unsigned address = size; address > 0;) {
+        address -= 16;
+        addresses.push_back(address);
+    }
+    ImageInfo info = parseText(makeHexText(addresses, 16));
+    CHECK(info.numDataRecords == size / 16);
+    checkContiguous(info, size);
+}
+
+// testAscending - Records in ascending order of address make one chunk
+static void testAscending()
+{
+    const unsigned size = 0x20000;
+    std::vector<unsigned> addresses;
+    for (unsigned address = 0; address < size; address += 32) {
+        addresses.push_back(address);
+    }
+    ImageInfo info = parseText(makeHexText(addresses, 32));
+    CHECK(info.maxDataSize == 32);
+    checkContiguous(info, size);
+}
+
+// testShuffled - Records in any order make the same chunks
+static void testShuffled()
+{
+    const unsigned size = 0x8000;
+    std::vector<unsigned> addresses;
+    for (unsigned address = 0; address < size; address += 16) {
+        addresses.push_back(address);
+    }
+    // A fixed permutation, so the test is repeatable
+    for (size_t i = addresses.size() - 1; i > 0; --i) {
+        std::swap(addresses[i], addresses[(i * 7919) % (i + 1)]);
+    }
+    checkContiguous(parseText(makeHexText(addresses, 16)), size);
+}
+
+// testGaps - Records that aren't contiguous make separate chunks, in descending
+// order of address in the list
+static void testGaps()
+{
+    ImageInfo info = parseText(makeHexText({ 0x300, 0x100, 0x110, 0x0, 0x310 }, 16));
+    CHECK(info.chunks.size() == 3);
+    std::vector<std::pair<unsigned, unsigned>> layout;
+    for (const Chunk& chunk : info.chunks) {
+        layout.push_back({ chunk.address, chunk.size });
+        CHECK(chunk.data.size() == chunk.size);
+        CHECK(chunk.data[0] == static_cast<unsigned char>(chunk.address));
+    }
+    CHECK((layout == std::vector<std::pair<unsigned, unsigned>>{ { 0x300, 0x20 }, { 0x100, 0x20 }, { 0x0, 0x10 } }));
+}
+
+// testOverlaps - Overlapping records are separate segments, each with the data
+// of the image where later records win, and each record that starts inside
+// earlier data is counted
+static void testOverlaps()
+{
+    const unsigned char a[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+    const unsigned char b[16] = { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 };
+    const unsigned char c[4] = { 3, 3, 3, 3 };
+    const unsigned char d[8] = { 4, 4, 4, 4, 4, 4, 4, 4 };
+    std::string text = makeRecord(typeData, 0x8, b) + makeRecord(typeData, 0x0, a) + makeRecord(typeData, 0x4, c)
+        + makeRecord(typeData, 0x18, d) + makeRecord(typeEof, 0, {});
+    ImageInfo info = parseText(text);
+    CHECK(info.numOverlapping == 2);
+    std::vector<std::pair<unsigned, unsigned>> layout;
+    for (const Chunk& chunk : std::ranges::reverse_view(info.chunks)) {
+        layout.push_back({ chunk.address, chunk.size });
+        CHECK(chunk.data.size() == chunk.size);
+    }
+    // d follows on from b, which ends last.
+    CHECK((layout == std::vector<std::pair<unsigned, unsigned>>{ { 0x0, 0x10 }, { 0x4, 0x4 }, { 0x8, 0x18 } }));
+    const unsigned char expected[0x20] = { 1, 1, 1, 1, 3, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+        4, 4, 4, 4, 4, 4, 4, 4 };
+    for (const Chunk& chunk : info.chunks) {
+        CHECK(std::ranges::equal(chunk.data, std::span(expected).subspan(chunk.address, chunk.size)));
+    }
+}
+
+// testLayoutOnly - Without keepData the chunks have the same layout and no data
+static void testLayoutOnly()
+{
+    std::string text = makeHexText({ 0x300, 0x100, 0x110, 0x0, 0x310, 0x108 }, 16);
+    ImageInfo withData = parseText(text);
+    ImageInfo layout = parseText(text, false);
+    CHECK(layout.chunks.size() == withData.chunks.size());
+    CHECK(layout.numOverlapping == withData.numOverlapping);
+    CHECK(layout.numDataRecords == withData.numDataRecords);
+    auto iChunkWithData = withData.chunks.begin();
+    for (const Chunk& chunk : layout.chunks) {
+        CHECK(chunk.address == iChunkWithData->address && chunk.size == iChunkWithData->size);
+        CHECK(chunk.data.empty());
+        ++iChunkWithData;
+    }
+}
+
+// testErrors - Invalid records are reported with their line
+static void testErrors()
+{
+    auto error = [](const std::string& text) {
+        try {
+            parseText(text);
+        } catch (const std::exception& e) {
+            return std::string(e.what());
+        }
+        return std::string();
+    };
+    CHECK(error(":0100000001FF\n:00000001FF\n").starts_with("Incorrect checksum\nLine 1:"));
+    CHECK(error(":01000000G1FE\n").starts_with("Invalid data in hex file\nLine 1:"));
+    CHECK(error(":00000001FF\n:00000001FF\n").starts_with("EOF record before end of file\nLine 2:"));
+    CHECK(error(":00000001FF\n").empty());
+}
+
+// makeUf2Block - Make a UF2 block with 256 bytes of data
+static Uf2Block makeUf2Block(unsigned address, unsigned blockNo, unsigned numBlocks)
+{
+    Uf2Block block = {};
+    block.magicStart0 = uf2MagicStart0;
+    block.magicStart1 = uf2MagicStart1;
+    block.magicEnd = uf2MagicEnd;
+    block.targetAddr = address;
+    block.payloadSize = 256;
+    block.blockNo = blockNo;
+    block.numBlocks = numBlocks;
+    return block;
+}
+
+static ImageInfo parseUf2(const std::vector<Uf2Block>& blocks)
+{
+    std::istringstream input(std::string(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(Uf2Block)));
+    ImageInfo info;
+    processUf2File(input, info);
+    return info;
+}
+
+// testUf2Sequences - Concatenated UF2 files are read as one image, which is
+// complete if each of them is
+static void testUf2Sequences()
+{
+    std::vector<Uf2Block> blocks = { makeUf2Block(0x0, 0, 2), makeUf2Block(0x100, 1, 2),
+        makeUf2Block(0x1000, 0, 1) };
+    ImageInfo info = parseUf2(blocks);
+    CHECK(info.foundEof);
+    CHECK(info.numDataRecords == 3);
+    CHECK(info.chunks.size() == 2);
+    // The first sequence is missing a block.
+    blocks.erase(blocks.begin() + 1);
+    CHECK(!parseUf2(blocks).foundEof);
+    // The number of blocks must stay the same within a sequence.
+    blocks = { makeUf2Block(0x0, 0, 2), makeUf2Block(0x100, 1, 3) };
+    try {
+        parseUf2(blocks);
+        CHECK(false);
+    } catch (const std::exception& e) {
+        CHECK(std::string_view(e.what()).starts_with("Number of UF2 blocks changed"));
+    }
+}
+
+// testLazy - A LazyImage has the same segments, counts and data as the eager
+// parser, including where records overlap
+static void testLazy()
+{
+#ifdef HEXFILEINFO_HAVE_USERFAULTFD
+    const unsigned char a[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+    const unsigned char b[16] = { 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2 };
+    const unsigned char c[4] = { 3, 3, 3, 3 };
+    std::string text = makeRecord(typeData, 0x8, b) + makeRecord(typeData, 0x0, a) + makeRecord(typeData, 0x4, c)
+        + makeHexText({ 0x300, 0x100, 0x110, 0xFF8, 0x310, 0x108, 0x1008, 0x2000 }, 16);
+    std::string fileName = (std::filesystem::temp_directory_path() / "ParserTests-lazy.hex").string();
+    std::ofstream(fileName, std::ios::binary) << text;
+    std::unique_ptr<LazyImage> lazy;
+    try {
+        lazy = std::make_unique<LazyImage>(fileName);
+    } catch (const std::exception& e) {
+        std::filesystem::remove(fileName);
+        if (std::string_view(e.what()).starts_with("userfaultfd")) {
+            throw TestSkipped(e.what());
+        }
+        throw;
+    }
+    std::filesystem::remove(fileName);
+    ImageInfo eager = parseText(text);
+    const ImageInfo& summary = lazy->summary();
+    CHECK(summary.numOverlapping == eager.numOverlapping);
+    CHECK(summary.numOverlapping == 4);
+    CHECK(summary.numDataRecords == eager.numDataRecords);
+    CHECK(summary.maxDataSize == eager.maxDataSize);
+    CHECK(std::ranges::equal(summary.recordCounts, eager.recordCounts));
+    CHECK(summary.lastLine == eager.lastLine);
+    // The segments are in ascending order, and the chunks in descending order.
+    CHECK(lazy->segments().size() == eager.chunks.size());
+    auto iChunk = eager.chunks.rbegin();
+    for (const LazyImage::Segment& segment : lazy->segments()) {
+        CHECK(segment.address == iChunk->address && segment.size == iChunk->size);
+        CHECK(std::ranges::equal(std::span(lazy->pointer(segment.address), segment.size), iChunk->data));
+        ++iChunk;
+    }
+    CHECK(lazy->error() == nullptr);
+#else
+    throw TestSkipped("LazyImage needs userfaultfd");
+#endif
+}
+
+// testHelperThreads - parallelFor calls in several threads share one budget of
+// helper threads, and the helper threads see the caller's inFileName
+static void testHelperThreads()
+{
+    const unsigned numCallers = 4;
+    const unsigned limit = 3;
+    HelperThreads::setLimit(limit);
+    std::atomic<unsigned> numRunning = 0;
+    std::atomic<unsigned> maxRunning = 0;
+    std::atomic<bool> namesMatch = true;
+    {
+        std::vector<std::jthread> callers;
+        for (unsigned iCaller = 0; iCaller < numCallers; ++iCaller) {
+            callers.emplace_back([&, iCaller] {
+                inFileName = std::format("file {}", iCaller);
+                parallelFor(64, 1, [&](size_t) {
+                    unsigned running = ++numRunning;
+                    for (unsigned max = maxRunning; running > max && !maxRunning.compare_exchange_weak(max, running);) {
+                    }
+                    if (inFileName != std::format("file {}", iCaller)) {
+                        namesMatch = false;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    --numRunning;
+                });
+            });
+        }
+    }
+    CHECK(maxRunning <= numCallers + limit);
+    CHECK(namesMatch);
+    // All the helper threads were given back.
+    HelperThreads all(100);
+    CHECK(all.count() == limit);
+}
+
+struct Test
+{
+    const char* name;
+    void (*run)();
+};
+
+const Test tests[] = {
+    { "descending", testDescending },
+    { "ascending", testAscending },
+    { "shuffled", testShuffled },
+    { "gaps", testGaps },
+    { "overlaps", testOverlaps },
+    { "layout-only", testLayoutOnly },
+    { "errors", testErrors },
+    { "uf2-sequences", testUf2Sequences },
+    { "lazy", testLazy },
+    { "helper-threads", testHelperThreads },
+};
+
+int main(int argc, char* argv[])
+{
+    int numFailed = 0;
+    int numSkipped = 0;
+    for (const Test& test : tests) {
+        if (argc > 1 && std::ranges::find(argv + 1, argv + argc, std::string_view(test.name)) == argv + argc) {
+            continue;
+        }
+        try {
+            test.run();
+            std::cout << "passed: " << test.name << '\n';
+        } catch (const TestSkipped& e) {
+            std::cout << "skipped: " << test.name << ": " << e.what() << '\n';
+            ++numSkipped;
+        } catch (const std::exception& e) {
+            std::cout << "FAILED: " << test.name << ": " << e.what() << '\n';
+            ++numFailed;
+        }
+    }
+    return numFailed > 0 ? 1 : numSkipped > 0 ? 77 : 0;
+}